@@ -1,11 +1,47 @@
 LOCAL_PATH := $(call my-dir)
+
+# H.264 support is optional, as OpenH264 needs to be provided separately.
+# Cisco's prebuilt binaries come with a patent license, so we link to
+# those instead of building from source.
+OPENH264_PATH := $(LOCAL_PATH)/../vendor/openh264
+
+ifneq ($(wildcard $(OPENH264_PATH)/include/wels/codec_api.h),)
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := openh264
+LOCAL_SRC_FILES := ../vendor/openh264/libs/$(TARGET_ARCH_ABI)/libopenh264.so
+LOCAL_EXPORT_C_INCLUDES := $(OPENH264_PATH)/include
+
+include $(PREBUILT_SHARED_LIBRARY)
+
+MINICAP_WITH_OPENH264 := true
+endif
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := minicap-common
 
 LOCAL_SRC_FILES := \
+	ChangeGate.cpp \
+	Client.cpp \
+	ClientManager.cpp \
+	EncodePool.cpp \
+	FramePacer.cpp \
 	JpgEncoder.cpp \
+	LatencyController.cpp \
+	MotionAdapter.cpp \
+	MuxClient.cpp \
+	MuxServer.cpp \
+	PngEncoder.cpp \
+	QoiEncoder.cpp \
+	RawEncoder.cpp \
+	SharedFrameBuffer.cpp \
 	SimpleServer.cpp \
+	SocketOptions.cpp \
+	StreamWriter.cpp \
+	TileCache.cpp \
+	TileEncoder.cpp \
+	ZeroCopySender.cpp \
 	minicap.cpp \
 
 LOCAL_STATIC_LIBRARIES := \
@@ -14,6 +50,15 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SHARED_LIBRARIES := \
 	minicap-shared \
 
+# For PNG.
+LOCAL_EXPORT_LDLIBS := -lz
+
+ifeq ($(MINICAP_WITH_OPENH264),true)
+LOCAL_SRC_FILES += H264Encoder.cpp
+LOCAL_CFLAGS += -DMINICAP_WITH_OPENH264
+LOCAL_SHARED_LIBRARIES += openh264
+endif
+
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
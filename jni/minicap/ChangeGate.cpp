@@ -0,0 +1,153 @@
+#include "ChangeGate.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "util/option.hpp"
+
+// Even small changes should show up within a reasonable time, e.g. the
+// clock.
+#define DEFAULT_INTERVAL_MS 5000
+
+ChangeGate::ChangeGate()
+  : mEnabled(false),
+    mThreshold(0),
+    mInterval(DEFAULT_INTERVAL_MS),
+    mHasLastFrame(false),
+    mLastWidth(0),
+    mLastHeight(0),
+    mLastFormat(Minicap::FORMAT_NONE) {
+}
+
+bool
+ChangeGate::set(const char* name, const char* value) {
+  if (strcmp(name, "mask") == 0) {
+    if (!region_parse_list(value, mMasks)) {
+      return false;
+    }
+
+    mEnabled = true;
+    return true;
+  }
+
+  long number;
+  if (!option_parse_number(value, &number)) {
+    return false;
+  }
+
+  if (strcmp(name, "threshold") == 0) {
+    mThreshold = number;
+    mEnabled = true;
+    return true;
+  }
+
+  if (strcmp(name, "interval") == 0) {
+    mInterval = std::chrono::milliseconds(number);
+    mEnabled = true;
+    return true;
+  }
+
+  return false;
+}
+
+bool
+ChangeGate::parse(const char* option) {
+  return option_parse(option, *this);
+}
+
+bool
+ChangeGate::isEnabled() const {
+  return mEnabled;
+}
+
+bool
+ChangeGate::check(Minicap::Frame* frame, Clock::time_point now, bool force) {
+  if (!mEnabled) {
+    return true;
+  }
+
+  bool send = force || !mHasLastFrame
+    || frame->width != mLastWidth || frame->height != mLastHeight
+    || frame->format != mLastFormat
+    || (mInterval.count() > 0 && now - mLastSentAt >= mInterval)
+    || countChanges(frame) > mThreshold;
+
+  if (send) {
+    remember(frame, now);
+  }
+
+  return send;
+}
+
+size_t
+ChangeGate::countChanges(Minicap::Frame* frame) {
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+  size_t rowSize = frame->width * frame->bpp;
+  size_t changes = 0;
+
+  for (uint32_t y = 0; y < frame->height; ++y) {
+    const unsigned char* current = data + y * stride;
+    const unsigned char* last = mLastPixels.data() + y * rowSize;
+
+    // The whole row is the same most of the time.
+    if (memcmp(current, last, rowSize) == 0) {
+      continue;
+    }
+
+    // Masks covering this row, left to right.
+    mRowMasks.clear();
+    for (auto& mask: mMasks) {
+      if (y >= mask.y && y < mask.y + mask.height && mask.x < frame->width) {
+        mRowMasks.push_back(mask);
+      }
+    }
+
+    std::sort(mRowMasks.begin(), mRowMasks.end(),
+      [](const region& a, const region& b) { return a.x < b.x; });
+
+    uint32_t x = 0;
+    size_t next = 0;
+
+    while (x < frame->width) {
+      // Skip over masks, which may overlap.
+      while (next < mRowMasks.size() && mRowMasks[next].x <= x) {
+        x = std::max(x, mRowMasks[next].x + mRowMasks[next].width);
+        next += 1;
+      }
+
+      uint32_t end = next < mRowMasks.size()
+        ? std::min(mRowMasks[next].x, frame->width)
+        : frame->width;
+
+      for (; x < end; ++x) {
+        if (memcmp(current + x * frame->bpp, last + x * frame->bpp, frame->bpp) != 0
+            && ++changes > mThreshold) {
+          return changes;
+        }
+      }
+    }
+  }
+
+  return changes;
+}
+
+void
+ChangeGate::remember(Minicap::Frame* frame, Clock::time_point now) {
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+  size_t rowSize = frame->width * frame->bpp;
+
+  mLastPixels.resize(rowSize * frame->height);
+
+  for (uint32_t y = 0; y < frame->height; ++y) {
+    memcpy(mLastPixels.data() + y * rowSize, data + y * stride, rowSize);
+  }
+
+  mHasLastFrame = true;
+  mLastWidth = frame->width;
+  mLastHeight = frame->height;
+  mLastFormat = frame->format;
+  mLastSentAt = now;
+}
@@ -0,0 +1,68 @@
+#ifndef MINICAP_CHANGE_GATE_HPP
+#define MINICAP_CHANGE_GATE_HPP
+
+#include <chrono>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Minicap.hpp"
+
+#include "util/region.hpp"
+
+// Decides whether a frame has changed enough since the last one that went
+// out to be worth sending. Changes within masked areas (e.g. the status
+// bar clock or a spinner) don't count, and neither do changes of up to a
+// given number of pixels (e.g. a blinking cursor). So that such changes
+// still show up eventually, a frame is always let through if the last one
+// was long enough ago.
+class ChangeGate {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  ChangeGate();
+
+  // Sets an option by name. Known options are "mask" (a space separated
+  // list of <x>,<y>,<w>,<h> rectangles, added to the current ones),
+  // "threshold" (the number of changed pixels to ignore) and "interval"
+  // (the longest time in milliseconds to hold back changes, or 0 for no
+  // limit). Returns false if the option is unknown or the value invalid.
+  bool
+  set(const char* name, const char* value);
+
+  // Parses "<name>=<value>".
+  bool
+  parse(const char* option);
+
+  bool
+  isEnabled() const;
+
+  // Returns true if the frame should be sent, and then remembers it as the
+  // last one sent. With force, the frame is always sent, e.g. because a
+  // new client needs one.
+  bool
+  check(Minicap::Frame* frame, Clock::time_point now, bool force);
+
+private:
+  bool mEnabled;
+  std::vector<region> mMasks;
+  size_t mThreshold;
+  std::chrono::milliseconds mInterval;
+  bool mHasLastFrame;
+  uint32_t mLastWidth;
+  uint32_t mLastHeight;
+  Minicap::Format mLastFormat;
+  Clock::time_point mLastSentAt;
+  std::vector<unsigned char> mLastPixels;
+  std::vector<region> mRowMasks;
+
+  // Counts changed pixels outside the masks, stopping early once there
+  // are more than the threshold.
+  size_t
+  countChanges(Minicap::Frame* frame);
+
+  void
+  remember(Minicap::Frame* frame, Clock::time_point now);
+};
+
+#endif
@@ -0,0 +1,989 @@
+#include "Client.hpp"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util/base64.hpp"
+#include "util/debug.h"
+#include "util/pump.hpp"
+#include "util/sha1.hpp"
+
+#define MJPEG_BOUNDARY "minicapframe"
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_PROTOCOL "minicap"
+
+enum {
+  WEBSOCKET_OPCODE_TEXT   = 0x1,
+  WEBSOCKET_OPCODE_BINARY = 0x2,
+  WEBSOCKET_OPCODE_CLOSE  = 0x8,
+  WEBSOCKET_OPCODE_PING   = 0x9,
+  WEBSOCKET_OPCODE_PONG   = 0xA,
+};
+
+// Finds the value of the given HTTP header. The headers must be NUL
+// terminated.
+static bool
+getHttpHeader(const char* headers, const char* name, char* value, size_t size) {
+  size_t nameLength = strlen(name);
+  const char* line = strstr(headers, "\r\n");
+
+  while (line != NULL) {
+    line += 2;
+
+    if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':') {
+      const char* start = line + nameLength + 1;
+      while (*start == ' ' || *start == '\t') {
+        start += 1;
+      }
+
+      const char* end = strstr(start, "\r\n");
+      if (end == NULL || static_cast<size_t>(end - start) >= size) {
+        return false;
+      }
+
+      memcpy(value, start, end - start);
+      value[end - start] = '\0';
+      return true;
+    }
+
+    line = strstr(line, "\r\n");
+  }
+
+  return false;
+}
+
+// Finds the value of the given parameter in the query string of the path.
+static bool
+getQueryParam(const char* path, const char* name, char* value, size_t size) {
+  const char* query = strchr(path, '?');
+  size_t nameLength = strlen(name);
+
+  while (query != NULL) {
+    query += 1;
+
+    if (strncmp(query, name, nameLength) == 0 && query[nameLength] == '=') {
+      const char* start = query + nameLength + 1;
+      size_t length = strcspn(start, "&");
+      if (length >= size) {
+        return false;
+      }
+
+      memcpy(value, start, length);
+      value[length] = '\0';
+      return true;
+    }
+
+    query = strchr(query, '&');
+  }
+
+  return false;
+}
+
+static void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+// Builds a WebSocket frame header for an unfragmented, unmasked message.
+static size_t
+putWebSocketHeader(unsigned char* header, int opcode, size_t length) {
+  header[0] = 0x80 | opcode;
+
+  if (length < 126) {
+    header[1] = length;
+    return 2;
+  }
+
+  if (length < 65536) {
+    header[1] = 126;
+    header[2] = (length >> 8) & 0xFF;
+    header[3] = length & 0xFF;
+    return 4;
+  }
+
+  header[1] = 127;
+  for (int i = 0; i < 8; ++i) {
+    header[2 + i] = (static_cast<uint64_t>(length) >> (56 - i * 8)) & 0xFF;
+  }
+
+  return 10;
+}
+
+// std::chrono::milliseconds takes it by reference.
+const unsigned int Client::MAX_KEY_FRAME_WAIT_MS;
+
+Client::Client(int fd, Protocol protocol, Listener* listener)
+  : mFd(fd),
+    mEventFd(eventfd(0, EFD_NONBLOCK)),
+    mProtocol(protocol),
+    mListener(listener),
+    mHasKeyFrame(false),
+    mKeyFrameSequence(0),
+    mHasLastFrame(false),
+    mLastFrameSequence(0),
+    mAwaitingKeyFrame(false),
+    mMaxFrameSize(0),
+    mMinFrameInterval(Clock::duration::zero()),
+    mNextFrameAt(Clock::now()),
+    mInputLength(0),
+    mOnDemand(false),
+    mScreenshotRequested(false),
+    mReady(false),
+    mStopping(false),
+    mClosed(false) {
+}
+
+Client::~Client() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+
+  // Wake up the thread whether it's polling or stuck in send().
+  wake();
+  ::shutdown(mFd, SHUT_RDWR);
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+
+  ::close(mFd);
+
+  if (mEventFd >= 0) {
+    ::close(mEventFd);
+  }
+}
+
+void
+Client::setOnDemand(bool onDemand) {
+  mOnDemand = onDemand;
+}
+
+void
+Client::setSocketOptions(const SocketOptions& options) {
+  mSocketOptions = options;
+}
+
+void
+Client::setMaxFrameSize(size_t maxFrameSize) {
+  mMaxFrameSize = maxFrameSize;
+}
+
+void
+Client::start(const std::vector<unsigned char>& banner) {
+  mBanner = banner;
+  mThread = std::thread(&Client::run, this);
+}
+
+void
+Client::push(std::shared_ptr<EncodedFrame> frame) {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrame = frame;
+  }
+
+  wake();
+}
+
+std::chrono::steady_clock::time_point
+Client::getDemandAt() {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  // Waiting for a key frame means that the pending frame won't do.
+  if (!mReady || mClosed || (mPendingFrame && !mAwaitingKeyFrame)) {
+    return Clock::time_point::max();
+  }
+
+  if (mOnDemand) {
+    return mScreenshotRequested ? Clock::time_point::min() : Clock::time_point::max();
+  }
+
+  return mNextFrameAt;
+}
+
+bool
+Client::takeScreenshotRequest(ScreenshotRequest* request) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (!mScreenshotRequested) {
+    return false;
+  }
+
+  *request = mScreenshotRequest;
+  mScreenshotRequested = false;
+
+  return true;
+}
+
+bool
+Client::isClosed() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  return mClosed;
+}
+
+void
+Client::run() {
+  if (!handshake()) {
+    goto close;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mReady = true;
+  }
+
+  // Large frames may well be worth sending without copying.
+  if (mProtocol == PROTOCOL_MINICAP) {
+    mSender.enable(mFd);
+  }
+
+  mListener->onClientStateChanged(this);
+
+  while (true) {
+    std::shared_ptr<EncodedFrame> frame;
+    int timeout = -1;
+    bool keyFrameNeeded = false;
+
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+
+      if (mStopping) {
+        break;
+      }
+
+      if (mPendingFrame) {
+        Clock::time_point now = Clock::now();
+
+        if (now >= mNextFrameAt) {
+          if (!isReplayTooLong(mPendingFrame.get())) {
+            mAwaitingKeyFrame = false;
+          }
+          else if (!mAwaitingKeyFrame) {
+            mAwaitingKeyFrame = true;
+            mKeyFrameDeadline = now + std::chrono::milliseconds(MAX_KEY_FRAME_WAIT_MS);
+            keyFrameNeeded = true;
+          }
+        }
+
+        if (mAwaitingKeyFrame && now < mKeyFrameDeadline) {
+          // Newer frames keep replacing the pending one until the key
+          // frame shows up.
+          timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+            mKeyFrameDeadline - now).count() + 1;
+        }
+        else if (now >= mNextFrameAt) {
+          mAwaitingKeyFrame = false;
+          frame = std::move(mPendingFrame);
+
+          // Keep to the grid so that the rate doesn't drift, unless we've
+          // fallen behind (or had nothing to send for a while), in which
+          // case we start over from now.
+          mNextFrameAt += mMinFrameInterval;
+          if (mNextFrameAt <= now) {
+            mNextFrameAt = now + mMinFrameInterval;
+          }
+        }
+        else {
+          // Hold on to the frame until it's due. A newer one may replace
+          // it in the meantime.
+          timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+            mNextFrameAt - now).count() + 1;
+        }
+      }
+    }
+
+    if (keyFrameNeeded) {
+      mListener->onKeyFrameRequested(this);
+    }
+
+    if (frame) {
+      if (!sendFrame(frame)) {
+        break;
+      }
+
+      if (mProtocol == PROTOCOL_JPEG) {
+        break;
+      }
+
+      frame.reset();
+      mListener->onClientStateChanged(this);
+      continue;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = mFd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = mEventFd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      MCERROR("Unable to poll client");
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      read(mEventFd, &value, sizeof(value));
+    }
+
+    // POLLERR may just mean that the kernel is done with frames we sent
+    // with zero copy.
+    if ((fds[0].revents & POLLERR) && mSender.reap(mFd)) {
+      fds[0].revents &= ~POLLERR;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (!processInput()) {
+        break;
+      }
+    }
+  }
+
+close:
+  MCINFO("Closing client connection");
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mClosed = true;
+    mPendingFrame.reset();
+  }
+
+  mListener->onClientStateChanged(this);
+}
+
+void
+Client::wake() {
+  uint64_t value = 1;
+  write(mEventFd, &value, sizeof(value));
+}
+
+bool
+Client::handshake() {
+  switch (mProtocol) {
+  case PROTOCOL_MINICAP:
+    return pumps(mFd, mBanner.data(), mBanner.size()) >= 0;
+  case PROTOCOL_HTTP:
+    return handshakeHttp();
+  case PROTOCOL_SHM:
+    return handshakeShm();
+  default:
+    return false;
+  }
+}
+
+bool
+Client::handshakeHttp() {
+  char* end;
+
+  // Read the whole request first.
+  while (true) {
+    mInput[mInputLength] = '\0';
+
+    if ((end = strstr(mInput, "\r\n\r\n")) != NULL) {
+      break;
+    }
+
+    if (mInputLength >= MAX_INPUT_LENGTH) {
+      MCINFO("HTTP request too large");
+      return false;
+    }
+
+    int got = recv(mFd, mInput + mInputLength, MAX_INPUT_LENGTH - mInputLength, 0);
+    if (got <= 0) {
+      return false;
+    }
+
+    mInputLength += got;
+  }
+
+  end += 2;
+  *end = '\0';
+
+  char method[8];
+  char path[256];
+  if (sscanf(mInput, "%7s %255s", method, path) != 2) {
+    return false;
+  }
+
+  if (strcmp(method, "GET") != 0) {
+    const char* response =
+      "HTTP/1.1 405 Method Not Allowed\r\n"
+      "Allow: GET\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+    pumps(mFd, reinterpret_cast<const unsigned char*>(response), strlen(response));
+    return false;
+  }
+
+  char value[256];
+  if (getQueryParam(path, "rate", value, sizeof(value))) {
+    setMaxFrameRate(atof(value));
+  }
+
+  int quality = -1;
+  if (getQueryParam(path, "quality", value, sizeof(value))) {
+    quality = atoi(value);
+    if (quality < 0 || quality > 100) {
+      quality = -1;
+    }
+  }
+
+  bool upgrade = getHttpHeader(mInput, "Upgrade", value, sizeof(value))
+    && strcasecmp(value, "websocket") == 0;
+
+  char response[512];
+  int responseLength;
+
+  if (upgrade) {
+    char key[128];
+    if (!getHttpHeader(mInput, "Sec-WebSocket-Key", key, sizeof(key))) {
+      return false;
+    }
+
+    unsigned char digest[sha1::DIGEST_SIZE];
+    sha1 hash;
+    hash.update(key, strlen(key));
+    hash.update(WEBSOCKET_GUID, strlen(WEBSOCKET_GUID));
+    hash.final(digest);
+
+    char accept[32];
+    base64_encode(digest, sizeof(digest), accept);
+
+    // Browsers refuse the connection unless we agree to one of the
+    // subprotocols they asked for.
+    bool subprotocol = getHttpHeader(mInput, "Sec-WebSocket-Protocol", value, sizeof(value))
+      && strstr(value, WEBSOCKET_PROTOCOL) != NULL;
+
+    responseLength = snprintf(response, sizeof(response),
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: %s\r\n"
+      "%s"
+      "\r\n",
+      accept,
+      subprotocol ? "Sec-WebSocket-Protocol: " WEBSOCKET_PROTOCOL "\r\n" : "");
+
+    mProtocol = PROTOCOL_WEBSOCKET;
+  }
+  else if (mOnDemand) {
+    // There's nothing to stream, so plain requests get a screenshot. The
+    // response headers go out together with the frame.
+    responseLength = 0;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mScreenshotRequest.quality = quality;
+    mScreenshotRequest.hasProjection = false;
+    mScreenshotRequested = true;
+    mProtocol = PROTOCOL_JPEG;
+  }
+  else {
+    responseLength = snprintf(response, sizeof(response),
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+      "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+      "Pragma: no-cache\r\n"
+      "Connection: close\r\n"
+      "\r\n");
+
+    mProtocol = PROTOCOL_MJPEG;
+  }
+
+  if (responseLength > 0 &&
+      pumps(mFd, reinterpret_cast<unsigned char*>(response), responseLength) < 0) {
+    return false;
+  }
+
+  // Keep whatever came after the request, e.g. the first WebSocket
+  // messages.
+  end += 2;
+  mInputLength -= end - mInput;
+  memmove(mInput, end, mInputLength);
+
+  if (mProtocol == PROTOCOL_WEBSOCKET) {
+    return parseWebSocketMessages();
+  }
+
+  mInputLength = 0;
+
+  return true;
+}
+
+bool
+Client::handshakeShm() {
+  mSharedBuffer.reset(new SharedFrameBuffer());
+
+  if (!mSharedBuffer->create(mMaxFrameSize)) {
+    return false;
+  }
+
+  // The shared memory and the eventfd come along with the banner.
+  int fds[2] = { mSharedBuffer->getFd(), mSharedBuffer->getEventFd() };
+
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct iovec iov;
+  iov.iov_base = mBanner.data();
+  iov.iov_len = mBanner.size();
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  ssize_t wrote = sendmsg(mFd, &msg, MSG_NOSIGNAL);
+  if (wrote < 0) {
+    MCINFO("Unable to send shared memory to client");
+    return false;
+  }
+
+  // Only the first chunk carries the descriptors, the rest of the banner
+  // can go out as usual.
+  return pumps(mFd, mBanner.data() + wrote, mBanner.size() - wrote) >= 0;
+}
+
+bool
+Client::sendFrame(const std::shared_ptr<EncodedFrame>& frame) {
+  switch (mProtocol) {
+  case PROTOCOL_MINICAP: {
+    // If we've just connected or skipped frames due to rate limiting, the
+    // client may be missing frames this one depends on. Those have to go
+    // out first, oldest first.
+    std::vector<std::shared_ptr<EncodedFrame>> frames(1, frame);
+    for (std::shared_ptr<EncodedFrame> reference = frame->getReference();
+        reference && !hasReceived(reference.get());
+        reference = reference->getReference()) {
+      frames.push_back(reference);
+    }
+
+    std::reverse(frames.begin(), frames.end());
+
+    // Each frame is preceded by its size.
+    std::vector<unsigned char> headers(4 * frames.size());
+    std::vector<struct iovec> iov(2 * frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+      EncodedFrame* next = frames[i].get();
+      putUInt32LE(&headers[4 * i], next->getSize());
+      iov[2 * i].iov_base = &headers[4 * i];
+      iov[2 * i].iov_len = 4;
+      iov[2 * i + 1].iov_base = next->getData();
+      iov[2 * i + 1].iov_len = next->getSize();
+
+      if (!next->getReference()) {
+        mHasKeyFrame = true;
+        mKeyFrameSequence = next->getSequence();
+      }
+    }
+
+    mHasLastFrame = true;
+    mLastFrameSequence = frame->getSequence();
+
+    return mSender.send(mFd, iov.data(), iov.size(), frames, headers) >= 0;
+  }
+  case PROTOCOL_MJPEG: {
+    if (frame->getSize() == 0) {
+      return true;
+    }
+
+    char header[128];
+    int headerLength = snprintf(header, sizeof(header),
+      "--" MJPEG_BOUNDARY "\r\n"
+      "Content-Type: image/jpeg\r\n"
+      "Content-Length: %u\r\n"
+      "\r\n",
+      static_cast<unsigned int>(frame->getSize()));
+
+    char trailer[] = "\r\n";
+
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerLength;
+    iov[1].iov_base = frame->getData();
+    iov[1].iov_len = frame->getSize();
+    iov[2].iov_base = trailer;
+    iov[2].iov_len = 2;
+
+    return pumpv(mFd, iov, 3) >= 0;
+  }
+  case PROTOCOL_JPEG: {
+    char header[256];
+    int headerLength;
+
+    if (frame->getSize() == 0) {
+      headerLength = snprintf(header, sizeof(header),
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n");
+    }
+    else {
+      headerLength = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: image/jpeg\r\n"
+        "Content-Length: %u\r\n"
+        "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        static_cast<unsigned int>(frame->getSize()));
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerLength;
+    iov[1].iov_base = frame->getData();
+    iov[1].iov_len = frame->getSize();
+
+    return pumpv(mFd, iov, 2) >= 0;
+  }
+  case PROTOCOL_WEBSOCKET: {
+    unsigned char header[10];
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = putWebSocketHeader(header, WEBSOCKET_OPCODE_BINARY, frame->getSize());
+    iov[1].iov_base = frame->getData();
+    iov[1].iov_len = frame->getSize();
+
+    return pumpv(mFd, iov, 2) >= 0;
+  }
+  case PROTOCOL_SHM:
+    return mSharedBuffer->write(frame.get());
+  default:
+    return false;
+  }
+}
+
+bool
+Client::hasReceived(EncodedFrame* frame) {
+  if (mHasLastFrame && frame->getSequence() == mLastFrameSequence) {
+    return true;
+  }
+
+  // Key frames stay valid for all the frames that refer to them, no matter
+  // how many we've skipped in between.
+  return !frame->getReference() && mHasKeyFrame
+    && frame->getSequence() == mKeyFrameSequence;
+}
+
+bool
+Client::isReplayTooLong(EncodedFrame* frame) {
+  unsigned int missing = 0;
+  size_t missingBytes = 0;
+
+  for (std::shared_ptr<EncodedFrame> reference = frame->getReference();
+      reference && !hasReceived(reference.get());
+      reference = reference->getReference()) {
+    // Key frames have to go out anyway.
+    if (!reference->getReference()) {
+      continue;
+    }
+
+    missing += 1;
+    missingBytes += reference->getSize();
+
+    // Tile frames may be large enough that even a few are too many.
+    if (missing > MAX_REPLAY_FRAMES || missingBytes > MAX_REPLAY_BYTES) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+Client::processInput() {
+  int got = recv(mFd, mInput + mInputLength,
+    MAX_INPUT_LENGTH - mInputLength, MSG_DONTWAIT);
+
+  if (got == 0) {
+    return false;
+  }
+
+  if (got < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+
+  mInputLength += got;
+
+  switch (mProtocol) {
+  case PROTOCOL_MINICAP:
+  case PROTOCOL_SHM:
+    return parseCommands();
+  case PROTOCOL_WEBSOCKET:
+    return parseWebSocketMessages();
+  default:
+    // HTTP clients aren't supposed to send anything after the request.
+    mInputLength = 0;
+    return true;
+  }
+}
+
+bool
+Client::parseCommands() {
+  char* start = mInput;
+  char* end = mInput + mInputLength;
+  char* newline;
+
+  while ((newline = static_cast<char*>(memchr(start, '\n', end - start))) != NULL) {
+    *newline = '\0';
+    handleCommand(start);
+    start = newline + 1;
+  }
+
+  mInputLength = end - start;
+
+  if (mInputLength >= MAX_COMMAND_LENGTH) {
+    MCERROR("Client command too long");
+    return false;
+  }
+
+  memmove(mInput, start, mInputLength);
+
+  return true;
+}
+
+bool
+Client::parseWebSocketMessages() {
+  unsigned char* input = reinterpret_cast<unsigned char*>(mInput);
+
+  while (mInputLength >= 2) {
+    int opcode = input[0] & 0x0F;
+    bool masked = (input[1] & 0x80) != 0;
+    size_t length = input[1] & 0x7F;
+    size_t offset = 2;
+
+    if (length == 126) {
+      if (mInputLength < 4) {
+        break;
+      }
+
+      length = (input[2] << 8) | input[3];
+      offset = 4;
+    }
+    else if (length == 127) {
+      MCINFO("WebSocket message too large");
+      return false;
+    }
+
+    // Clients must always mask their messages.
+    if (!masked) {
+      return false;
+    }
+
+    if (offset + 4 + length > MAX_INPUT_LENGTH) {
+      MCINFO("WebSocket message too large");
+      return false;
+    }
+
+    if (mInputLength < offset + 4 + length) {
+      break;
+    }
+
+    unsigned char* mask = input + offset;
+    unsigned char* payload = mask + 4;
+
+    for (size_t i = 0; i < length; ++i) {
+      payload[i] ^= mask[i % 4];
+    }
+
+    switch (opcode) {
+    case WEBSOCKET_OPCODE_TEXT: {
+      // Every text message is a command.
+      char line[MAX_COMMAND_LENGTH];
+      size_t lineLength = length < sizeof(line) - 1 ? length : sizeof(line) - 1;
+      memcpy(line, payload, lineLength);
+      line[lineLength] = '\0';
+      handleCommand(line);
+      break;
+    }
+    case WEBSOCKET_OPCODE_CLOSE:
+      return false;
+    case WEBSOCKET_OPCODE_PING: {
+      unsigned char header[10];
+
+      struct iovec iov[2];
+      iov[0].iov_base = header;
+      iov[0].iov_len = putWebSocketHeader(header, WEBSOCKET_OPCODE_PONG, length);
+      iov[1].iov_base = payload;
+      iov[1].iov_len = length;
+
+      if (pumpv(mFd, iov, 2) < 0) {
+        return false;
+      }
+
+      break;
+    }
+    default:
+      break;
+    }
+
+    size_t consumed = offset + 4 + length;
+    mInputLength -= consumed;
+    memmove(mInput, mInput + consumed, mInputLength);
+  }
+
+  return true;
+}
+
+void
+Client::handleCommand(char* line) {
+  char* saveptr;
+  char* command = strtok_r(line, " \t\r\n", &saveptr);
+
+  if (command == NULL) {
+    return;
+  }
+
+  if (strcmp(command, "rate") == 0) {
+    char* arg = strtok_r(NULL, " \t\r", &saveptr);
+    if (arg == NULL || atof(arg) < 0) {
+      MCINFO("Invalid client frame rate, expecting a float >= 0");
+      return;
+    }
+
+    setMaxFrameRate(atof(arg));
+    mListener->onClientStateChanged(this);
+    return;
+  }
+
+  if (strcmp(command, "sockopt") == 0) {
+    char* arg = strtok_r(NULL, " \t\r", &saveptr);
+    if (arg == NULL || !mSocketOptions.parse(arg)) {
+      MCINFO("Invalid socket option, expecting <name>=<value>");
+      return;
+    }
+
+    mSocketOptions.apply(mFd);
+    return;
+  }
+
+  if (strcmp(command, "shot") == 0) {
+    if (!mOnDemand) {
+      MCINFO("Ignoring screenshot request, not in on-demand mode");
+      return;
+    }
+
+    requestScreenshot(saveptr);
+    mListener->onClientStateChanged(this);
+    return;
+  }
+
+  if (strcmp(command, "roi") == 0) {
+    // The rest of the line is the list of regions, which may well be
+    // empty.
+    char* value = saveptr != NULL ? saveptr + strspn(saveptr, " \t") : NULL;
+    char* end = value != NULL ? value + strlen(value) : NULL;
+
+    while (end != NULL && end > value && strchr(" \t\r", end[-1]) != NULL) {
+      *--end = '\0';
+    }
+
+    mListener->onCodecOptionRequested(this, "roi", value != NULL ? value : "");
+    return;
+  }
+
+  if (strcmp(command, "boost") == 0) {
+    char* arg = strtok_r(NULL, " \t\r", &saveptr);
+    char* end;
+    long duration = arg != NULL ? strtol(arg, &end, 10) : -1;
+
+    if (arg == NULL || *end != '\0' || duration < 0 || duration > MAX_BOOST_DURATION) {
+      MCINFO("Invalid boost duration, expecting 0-%u ms", MAX_BOOST_DURATION);
+      return;
+    }
+
+    // Same as for roi.
+    char* value = saveptr != NULL ? saveptr + strspn(saveptr, " \t") : NULL;
+    char* valueEnd = value != NULL ? value + strlen(value) : NULL;
+
+    while (valueEnd != NULL && valueEnd > value && strchr(" \t\r", valueEnd[-1]) != NULL) {
+      *--valueEnd = '\0';
+    }
+
+    mListener->onBoostRequested(this, duration, value != NULL ? value : "");
+    return;
+  }
+
+  MCINFO("Ignoring unknown client command '%s'", command);
+}
+
+void
+Client::setMaxFrameRate(float frameRate) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (frameRate > 0) {
+    mMinFrameInterval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(1.0 / frameRate));
+  }
+  else {
+    mMinFrameInterval = Clock::duration::zero();
+  }
+
+  mNextFrameAt = Clock::now();
+
+  MCINFO("Client frame rate limited to %.2f (0 = unlimited)", frameRate);
+}
+
+void
+Client::requestScreenshot(char* saveptr) {
+  ScreenshotRequest request;
+  request.quality = -1;
+  request.hasProjection = false;
+
+  char* arg;
+  while ((arg = strtok_r(NULL, " \t\r", &saveptr)) != NULL) {
+    if (strchr(arg, '@') != NULL) {
+      Projection::Parser parser;
+      if (!parser.parse(request.projection, arg, arg + strlen(arg))) {
+        MCINFO("Invalid screenshot projection '%s'", arg);
+        continue;
+      }
+
+      request.hasProjection = true;
+    }
+    else {
+      int quality = atoi(arg);
+      if (quality < 0 || quality > 100) {
+        MCINFO("Invalid screenshot quality '%s'", arg);
+        continue;
+      }
+
+      request.quality = quality;
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  mScreenshotRequest = request;
+  mScreenshotRequested = true;
+}
@@ -0,0 +1,205 @@
+#ifndef MINICAP_CLIENT_HPP
+#define MINICAP_CLIENT_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "EncodedFrame.hpp"
+#include "Projection.hpp"
+#include "SharedFrameBuffer.hpp"
+#include "SocketOptions.hpp"
+#include "ZeroCopySender.hpp"
+
+// A single connected client. Each client has its own thread for sending
+// frames and reading commands, so that a slow client can't hold up the
+// others.
+class Client {
+public:
+  enum Protocol {
+    // Our own binary protocol.
+    PROTOCOL_MINICAP,
+    // Any of the below, depending on the HTTP request.
+    PROTOCOL_HTTP,
+    // A multipart/x-mixed-replace stream of JPEGs.
+    PROTOCOL_MJPEG,
+    // A single JPEG, after which the connection is closed.
+    PROTOCOL_JPEG,
+    // One JPEG per binary message.
+    PROTOCOL_WEBSOCKET,
+    // Frames go through shared memory, which is handed over together with
+    // the banner. The socket itself is only used for commands.
+    PROTOCOL_SHM,
+  };
+
+  struct Listener {
+    virtual
+    ~Listener() {}
+
+    // Called from the client's thread when the client becomes able to
+    // take a new frame, or when it has closed.
+    virtual void
+    onClientStateChanged(Client* client) = 0;
+
+    // Called from the client's thread when the client wants to change a
+    // codec option. Codec options apply to all clients.
+    virtual void
+    onCodecOptionRequested(Client* client, const char* name, const char* value) = 0;
+
+    // Called from the client's thread when the client is about to interact
+    // with the device, and wants frames as fast as possible for the given
+    // number of milliseconds. The regions, if any, are where the action
+    // is, in the same format as the roi command.
+    virtual void
+    onBoostRequested(Client* client, unsigned int duration, const char* regions) = 0;
+
+    // Called from the client's thread when the client has missed too many
+    // frames to catch up on, and would rather wait for a key frame.
+    virtual void
+    onKeyFrameRequested(Client* client) = 0;
+  };
+
+  // A client that has missed more than this many frames (or bytes) that
+  // depend on the previous one (e.g. due to the rate limit) waits for a
+  // key frame instead of getting all of them in one go. If the key frame doesn't
+  // come within MAX_KEY_FRAME_WAIT_MS (e.g. because the screen stays
+  // still), the missed frames go out after all.
+  static const unsigned int MAX_REPLAY_FRAMES = 4;
+  static const size_t MAX_REPLAY_BYTES = 256 * 1024;
+  static const unsigned int MAX_KEY_FRAME_WAIT_MS = 1000;
+
+  struct ScreenshotRequest {
+    // Negative for the default quality.
+    int quality;
+    bool hasProjection;
+    Projection projection;
+  };
+
+  Client(int fd, Protocol protocol, Listener* listener);
+
+  ~Client();
+
+  // On-demand clients only receive frames they've explicitly requested
+  // with the "shot" command. Must be set before start().
+  void
+  setOnDemand(bool onDemand);
+
+  // The options the connection was set up with. Clients may tune them
+  // further with the "sockopt" command. Must be set before start().
+  void
+  setSocketOptions(const SocketOptions& options);
+
+  // The largest frame shared memory clients need room for. Must be set
+  // before start().
+  void
+  setMaxFrameSize(size_t maxFrameSize);
+
+  // Starts serving the client on its own thread. Clients using our own
+  // protocol receive the banner first.
+  void
+  start(const std::vector<unsigned char>& banner);
+
+  // Hands a frame over to the client. Only the latest frame is kept; if
+  // the previous one hasn't been sent yet, it simply gets dropped.
+  void
+  push(std::shared_ptr<EncodedFrame> frame);
+
+  // Returns the point in time at which the client will want its next
+  // frame, or time_point::max() if it doesn't currently want one.
+  std::chrono::steady_clock::time_point
+  getDemandAt();
+
+  // Takes the client's outstanding screenshot request, if any. The
+  // resulting frame should be handed over with push().
+  bool
+  takeScreenshotRequest(ScreenshotRequest* request);
+
+  bool
+  isClosed();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  static const size_t MAX_INPUT_LENGTH = 4096;
+  static const size_t MAX_COMMAND_LENGTH = 256;
+  static const unsigned int MAX_BOOST_DURATION = 10000;
+
+  int mFd;
+  int mEventFd;
+  Protocol mProtocol;
+  Listener* mListener;
+  SocketOptions mSocketOptions;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::vector<unsigned char> mBanner;
+  std::shared_ptr<EncodedFrame> mPendingFrame;
+  bool mHasKeyFrame;
+  uint32_t mKeyFrameSequence;
+  bool mHasLastFrame;
+  uint32_t mLastFrameSequence;
+  bool mAwaitingKeyFrame;
+  Clock::time_point mKeyFrameDeadline;
+  size_t mMaxFrameSize;
+  std::unique_ptr<SharedFrameBuffer> mSharedBuffer;
+  ZeroCopySender mSender;
+  Clock::duration mMinFrameInterval;
+  Clock::time_point mNextFrameAt;
+  char mInput[MAX_INPUT_LENGTH + 1];
+  size_t mInputLength;
+  bool mOnDemand;
+  bool mScreenshotRequested;
+  ScreenshotRequest mScreenshotRequest;
+  bool mReady;
+  bool mStopping;
+  bool mClosed;
+
+  void
+  run();
+
+  void
+  wake();
+
+  bool
+  handshake();
+
+  bool
+  handshakeHttp();
+
+  bool
+  handshakeShm();
+
+  bool
+  sendFrame(const std::shared_ptr<EncodedFrame>& frame);
+
+  // Whether the client already has the frame, for frames that other
+  // frames depend on.
+  bool
+  hasReceived(EncodedFrame* frame);
+
+  // Whether the client is missing too many of the frames that the frame
+  // depends on.
+  bool
+  isReplayTooLong(EncodedFrame* frame);
+
+  bool
+  processInput();
+
+  bool
+  parseCommands();
+
+  bool
+  parseWebSocketMessages();
+
+  void
+  handleCommand(char* line);
+
+  void
+  setMaxFrameRate(float frameRate);
+
+  void
+  requestScreenshot(char* saveptr);
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include "ClientManager.hpp"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util/debug.h"
+
+ClientManager::ClientManager()
+  : mTimeout(std::chrono::milliseconds(100)),
+    mBoostListener(NULL),
+    mBoostRequested(false),
+    mMaxFrameSize(0),
+    mOnDemand(false),
+    mKeyFrameRequested(false),
+    mStopped(false) {
+}
+
+ClientManager::~ClientManager() {
+  stop();
+}
+
+void
+ClientManager::setBanner(const unsigned char* banner, size_t bannerSize) {
+  mBanner.assign(banner, banner + bannerSize);
+}
+
+const std::vector<unsigned char>&
+ClientManager::getBanner() const {
+  return mBanner;
+}
+
+void
+ClientManager::setMaxFrameSize(size_t maxFrameSize) {
+  mMaxFrameSize = maxFrameSize;
+}
+
+void
+ClientManager::setBoostListener(BoostListener* listener) {
+  mBoostListener = listener;
+}
+
+void
+ClientManager::listen(SimpleServer* server, Client::Protocol protocol) {
+  mServers.push_back(server);
+  mAcceptThreads.push_back(std::thread(&ClientManager::acceptClients, this, server, protocol));
+}
+
+void
+ClientManager::setOnDemand(bool onDemand) {
+  mOnDemand = onDemand;
+}
+
+void
+ClientManager::addSubscriber(Subscriber* subscriber) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mSubscribers.push_back(subscriber);
+  mKeyFrameRequested = true;
+  mCondition.notify_all();
+}
+
+void
+ClientManager::removeSubscriber(Subscriber* subscriber) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mSubscribers.erase(std::remove(mSubscribers.begin(), mSubscribers.end(), subscriber),
+    mSubscribers.end());
+}
+
+void
+ClientManager::notifySubscriberStateChanged() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mCondition.notify_all();
+}
+
+void
+ClientManager::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+    mSubscribers.clear();
+  }
+
+  // Unblocks accept().
+  for (auto server: mServers) {
+    server->shutdown();
+  }
+
+  for (auto& thread: mAcceptThreads) {
+    thread.join();
+  }
+
+  mServers.clear();
+  mAcceptThreads.clear();
+
+  std::vector<std::shared_ptr<Client>> clients;
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    clients.swap(mClients);
+  }
+}
+
+bool
+ClientManager::waitForDemand(bool* deferred) {
+  std::vector<std::shared_ptr<Client>> closed;
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  Clock::time_point timeoutAt = Clock::now() + mTimeout;
+
+  *deferred = false;
+
+  while (!mStopped) {
+    takeClosedClients(closed);
+
+    Clock::time_point demandAt = Clock::time_point::max();
+    for (auto& client: mClients) {
+      demandAt = std::min(demandAt, client->getDemandAt());
+    }
+
+    for (auto subscriber: mSubscribers) {
+      demandAt = std::min(demandAt, subscriber->getDemandAt());
+    }
+
+    Clock::time_point now = Clock::now();
+
+    if (demandAt <= now) {
+      return true;
+    }
+
+    if (now >= timeoutAt) {
+      return false;
+    }
+
+    if (demandAt < timeoutAt) {
+      *deferred = true;
+      mCondition.wait_until(lock, demandAt);
+    }
+    else {
+      mCondition.wait_until(lock, timeoutAt);
+    }
+  }
+
+  return false;
+}
+
+void
+ClientManager::publish(std::shared_ptr<EncodedFrame> frame) {
+  std::vector<std::shared_ptr<Client>> closed;
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  takeClosedClients(closed);
+
+  for (auto& client: mClients) {
+    client->push(frame);
+  }
+
+  for (auto subscriber: mSubscribers) {
+    subscriber->push(frame);
+  }
+}
+
+void
+ClientManager::takeScreenshotRequests(std::vector<ScreenshotRequest>& requests) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  for (auto& client: mClients) {
+    ScreenshotRequest request;
+    if (client->takeScreenshotRequest(&request.options)) {
+      request.client = client;
+      requests.push_back(request);
+    }
+  }
+}
+
+bool
+ClientManager::takeKeyFrameRequest() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  bool requested = mKeyFrameRequested;
+  mKeyFrameRequested = false;
+  return requested;
+}
+
+void
+ClientManager::takeCodecOptions(std::vector<CodecOption>& options) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  options.swap(mCodecOptions);
+  mCodecOptions.clear();
+}
+
+void
+ClientManager::onCodecOptionRequested(Client* client, const char* name, const char* value) {
+  CodecOption option;
+  option.name = name;
+  option.value = value;
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  mCodecOptions.push_back(option);
+}
+
+bool
+ClientManager::takeBoostRequest(Boost* boost) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (!mBoostRequested) {
+    return false;
+  }
+
+  *boost = mBoost;
+  mBoostRequested = false;
+  return true;
+}
+
+void
+ClientManager::onBoostRequested(Client* client, unsigned int duration, const char* regions) {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mBoost.until = Clock::now() + std::chrono::milliseconds(duration);
+    mBoost.regions = regions;
+    mBoostRequested = true;
+  }
+
+  if (mBoostListener != NULL) {
+    mBoostListener->onBoostRequested();
+  }
+}
+
+void
+ClientManager::onKeyFrameRequested(Client* client) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mKeyFrameRequested = true;
+
+  // The client wants a new frame right away, too.
+  mCondition.notify_all();
+}
+
+void
+ClientManager::onClientStateChanged(Client* client) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mCondition.notify_all();
+}
+
+void
+ClientManager::acceptClients(SimpleServer* server, Client::Protocol protocol) {
+  while (true) {
+    int fd = server->accept();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (fd < 0) {
+      if (mStopped) {
+        break;
+      }
+
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      MCERROR("Unable to accept client connection");
+      break;
+    }
+
+    if (mStopped) {
+      ::close(fd);
+      break;
+    }
+
+    MCINFO("New client connection");
+
+    std::shared_ptr<Client> client = std::make_shared<Client>(fd, protocol, this);
+    client->setOnDemand(mOnDemand);
+    client->setSocketOptions(server->getSocketOptions());
+    client->setMaxFrameSize(mMaxFrameSize);
+    client->start(mBanner);
+    mClients.push_back(client);
+    mKeyFrameRequested = true;
+    mCondition.notify_all();
+  }
+}
+
+void
+ClientManager::takeClosedClients(std::vector<std::shared_ptr<Client>>& closed) {
+  for (auto it = mClients.begin(); it != mClients.end();) {
+    if ((*it)->isClosed()) {
+      closed.push_back(*it);
+      it = mClients.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
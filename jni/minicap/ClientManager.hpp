@@ -0,0 +1,182 @@
+#ifndef MINICAP_CLIENT_MANAGER_HPP
+#define MINICAP_CLIENT_MANAGER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Client.hpp"
+#include "EncodedFrame.hpp"
+#include "SimpleServer.hpp"
+
+// Accepts clients and fans encoded frames out to them. Also keeps track of
+// whether any client actually wants a frame, so that we don't waste time
+// encoding frames nobody is going to receive.
+class ClientManager: public Client::Listener {
+public:
+  struct ScreenshotRequest {
+    std::shared_ptr<Client> client;
+    Client::ScreenshotRequest options;
+  };
+
+  struct CodecOption {
+    std::string name;
+    std::string value;
+  };
+
+  struct Boost {
+    std::chrono::steady_clock::time_point until;
+    std::string regions;
+  };
+
+  struct BoostListener {
+    virtual
+    ~BoostListener() {}
+
+    // Called from the client's thread, so that whatever the main loop is
+    // waiting for can be cut short.
+    virtual void
+    onBoostRequested() = 0;
+  };
+
+  // Something other than a client of our own that takes frames, e.g. a
+  // multiplexed connection subscribed to this stream. Called with our
+  // lock held, so must not call back into us.
+  struct Subscriber {
+    virtual
+    ~Subscriber() {}
+
+    // Same as Client::getDemandAt().
+    virtual std::chrono::steady_clock::time_point
+    getDemandAt() = 0;
+
+    // Same as Client::push().
+    virtual void
+    push(std::shared_ptr<EncodedFrame> frame) = 0;
+  };
+
+  ClientManager();
+
+  ~ClientManager();
+
+  // Sets the banner that clients using our own protocol receive first.
+  // Must be called before listen().
+  void
+  setBanner(const unsigned char* banner, size_t bannerSize);
+
+  const std::vector<unsigned char>&
+  getBanner() const;
+
+  // Sets the largest frame size that shared memory clients need room for.
+  // Must be called before listen().
+  void
+  setMaxFrameSize(size_t maxFrameSize);
+
+  // Starts accepting clients from the server on a separate thread. May be
+  // called for several servers, each speaking its own protocol.
+  void
+  listen(SimpleServer* server, Client::Protocol protocol);
+
+  // Sets a listener to be told about boost requests as soon as they come
+  // in. Must be called before listen().
+  void
+  setBoostListener(BoostListener* listener);
+
+  // Makes new clients on-demand, i.e. they only receive the screenshots
+  // they ask for.
+  void
+  setOnDemand(bool onDemand);
+
+  // Adds a subscriber, which is treated like a client until removed. The
+  // next frame should preferably be a key frame, as for new clients.
+  void
+  addSubscriber(Subscriber* subscriber);
+
+  void
+  removeSubscriber(Subscriber* subscriber);
+
+  // Tells us that a subscriber may want a new frame.
+  void
+  notifySubscriberStateChanged();
+
+  // Stops accepting clients and disconnects all existing ones. Also
+  // drops all subscribers.
+  void
+  stop();
+
+  // Waits until at least one client wants a new frame. Returns false on
+  // timeout so that the caller gets a chance to check whether it should
+  // stop. If we had to wait for a rate limited client to become due,
+  // deferred is set to true, meaning that any frames that became available
+  // in the meantime are already stale.
+  bool
+  waitForDemand(bool* deferred);
+
+  // Hands the frame to all clients.
+  void
+  publish(std::shared_ptr<EncodedFrame> frame);
+
+  // Whether a client has connected or asked for a key frame since the last
+  // call, in which case the next frame should preferably be a key frame.
+  bool
+  takeKeyFrameRequest();
+
+  // Collects outstanding screenshot requests from on-demand clients.
+  void
+  takeScreenshotRequests(std::vector<ScreenshotRequest>& requests);
+
+  // Collects codec options requested by clients, oldest first.
+  void
+  takeCodecOptions(std::vector<CodecOption>& options);
+
+  // Whether a client has asked for a boost since the last call. If so,
+  // the latest request replaces any earlier ones.
+  bool
+  takeBoostRequest(Boost* boost);
+
+  void
+  onClientStateChanged(Client* client);
+
+  void
+  onCodecOptionRequested(Client* client, const char* name, const char* value);
+
+  void
+  onBoostRequested(Client* client, unsigned int duration, const char* regions);
+
+  void
+  onKeyFrameRequested(Client* client);
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  std::vector<SimpleServer*> mServers;
+  std::vector<std::thread> mAcceptThreads;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::chrono::milliseconds mTimeout;
+  std::vector<std::shared_ptr<Client>> mClients;
+  std::vector<Subscriber*> mSubscribers;
+  std::vector<unsigned char> mBanner;
+  std::vector<CodecOption> mCodecOptions;
+  BoostListener* mBoostListener;
+  bool mBoostRequested;
+  Boost mBoost;
+  size_t mMaxFrameSize;
+  bool mOnDemand;
+  bool mKeyFrameRequested;
+  bool mStopped;
+
+  void
+  acceptClients(SimpleServer* server, Client::Protocol protocol);
+
+  // Moves closed clients to the given list. They must be destroyed only
+  // after releasing the lock, as destroying a client joins its thread.
+  void
+  takeClosedClients(std::vector<std::shared_ptr<Client>>& closed);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include "EncodePool.hpp"
+
+EncodePool::EncodePool(unsigned int threads)
+  : mStopped(false) {
+  for (unsigned int i = 0; i < threads; ++i) {
+    mThreads.push_back(std::thread(&EncodePool::work, this));
+  }
+}
+
+EncodePool::~EncodePool() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+    mQueued.notify_all();
+  }
+
+  for (auto& thread: mThreads) {
+    thread.join();
+  }
+}
+
+bool
+EncodePool::run(std::function<bool()> job) {
+  Job pending;
+  pending.work = job;
+  pending.done = false;
+  pending.result = false;
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  mJobs.push_back(&pending);
+  mQueued.notify_one();
+
+  mDone.wait(lock, [&pending]{return pending.done;});
+
+  return pending.result;
+}
+
+void
+EncodePool::work() {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    mQueued.wait(lock, [this]{return mStopped || !mJobs.empty();});
+
+    if (mStopped) {
+      break;
+    }
+
+    Job* job = mJobs.front();
+    mJobs.pop_front();
+
+    lock.unlock();
+    bool result = job->work();
+    lock.lock();
+
+    job->result = result;
+    job->done = true;
+    mDone.notify_all();
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef MINICAP_ENCODE_POOL_HPP
+#define MINICAP_ENCODE_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that encode frames for all displays. Each display has
+// its own encoder, but with a single pool, the number of encodes running
+// at once stays bounded no matter how many displays there are, and
+// displays that are busy at different times share the same threads.
+class EncodePool {
+public:
+  EncodePool(unsigned int threads);
+
+  ~EncodePool();
+
+  // Runs the job on one of the workers, and waits for it to finish.
+  // Returns whatever the job returned. May be called from any thread.
+  bool
+  run(std::function<bool()> job);
+
+private:
+  struct Job {
+    std::function<bool()> work;
+    bool done;
+    bool result;
+  };
+
+  std::mutex mMutex;
+  std::condition_variable mQueued;
+  std::condition_variable mDone;
+  std::deque<Job*> mJobs;
+  std::vector<std::thread> mThreads;
+  bool mStopped;
+
+  void
+  work();
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef MINICAP_ENCODED_FRAME_HPP
+#define MINICAP_ENCODED_FRAME_HPP
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+// An encoded frame, ready to be sent out. Frames are handed to clients as
+// std::shared_ptr so that every client can send the same buffer without
+// copying it, and the frame only needs to be encoded once regardless of
+// how many clients are connected. Only the data is kept here; whatever
+// framing the protocol needs is added by the client as it sends the frame.
+class EncodedFrame {
+public:
+  EncodedFrame()
+    : mCapacity(0),
+      mSize(0),
+      mSequence(0) {
+  }
+
+  // Copies the encoded data into the frame, growing the buffer if needed.
+  void
+  assign(const unsigned char* data, size_t size) {
+    if (size > mCapacity) {
+      mCapacity = size;
+      mBuffer.reset(new unsigned char[mCapacity]);
+    }
+
+    if (size > 0) {
+      memcpy(mBuffer.get(), data, size);
+    }
+
+    mSize = size;
+    mReference.reset();
+  }
+
+  unsigned char*
+  getData() {
+    return mBuffer.get();
+  }
+
+  size_t
+  getSize() {
+    return mSize;
+  }
+
+  uint32_t
+  getSequence() {
+    return mSequence;
+  }
+
+  void
+  setSequence(uint32_t sequence) {
+    mSequence = sequence;
+  }
+
+  std::chrono::steady_clock::time_point
+  getCapturedAt() {
+    return mCapturedAt;
+  }
+
+  void
+  setCapturedAt(std::chrono::steady_clock::time_point capturedAt) {
+    mCapturedAt = capturedAt;
+  }
+
+  // The frame this one was encoded relative to, if any. Clients that
+  // haven't received it yet (or what it in turn refers to) need to get it
+  // first.
+  std::shared_ptr<EncodedFrame>
+  getReference() {
+    return mReference;
+  }
+
+  void
+  setReference(std::shared_ptr<EncodedFrame> reference) {
+    mReference = reference;
+  }
+
+private:
+  std::unique_ptr<unsigned char[]> mBuffer;
+  size_t mCapacity;
+  size_t mSize;
+  uint32_t mSequence;
+  std::chrono::steady_clock::time_point mCapturedAt;
+  std::shared_ptr<EncodedFrame> mReference;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef MINICAP_FRAME_ENCODER_HPP
+#define MINICAP_FRAME_ENCODER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Minicap.hpp"
+
+// Turns captured frames into whatever we send out. The codec is announced
+// in the banner so that clients know what to expect.
+class FrameEncoder {
+public:
+  enum Reference {
+    // The frame can be decoded on its own.
+    REFERENCE_NONE,
+    // The frame is relative to the last frame that could be decoded on its
+    // own.
+    REFERENCE_KEY_FRAME,
+    // The frame is relative to the previous frame.
+    REFERENCE_PREVIOUS_FRAME,
+  };
+
+  enum Codec {
+    CODEC_JPEG = 0,
+    CODEC_RAW  = 1,
+    CODEC_QOI  = 2,
+    CODEC_PNG  = 3,
+    CODEC_H264 = 4,
+    CODEC_JPEG_ABBREVIATED = 5,
+    CODEC_TILES = 6,
+  };
+
+  virtual
+  ~FrameEncoder() {}
+
+  virtual Codec
+  getCodec() = 0;
+
+  // Sets a codec specific option. Returns false if the option is unknown
+  // or the value is invalid.
+  virtual bool
+  setOption(const char* name, const char* value) {
+    return false;
+  }
+
+  // Makes room for frames of up to the given size.
+  virtual bool
+  reserveData(uint32_t width, uint32_t height) = 0;
+
+  // The largest frame that encode() may produce at the given size, e.g.
+  // for sizing buffers that frames are copied into. Codecs that can't
+  // bound it tighter assume raw RGBA.
+  virtual size_t
+  getMaxEncodedSize(uint32_t width, uint32_t height) {
+    return static_cast<size_t>(width) * height * 4;
+  }
+
+  // Encodes the frame. The quality may be ignored by lossless codecs.
+  virtual bool
+  encode(Minicap::Frame* frame, unsigned int quality) = 0;
+
+  virtual int
+  getEncodedSize() = 0;
+
+  virtual unsigned char*
+  getEncodedData() = 0;
+
+  // Some codecs send data that frames have in common separately, e.g. the
+  // tables of abbreviated JPEG. Returns the size of such data if the last
+  // call to encode() produced new data of that kind, or 0 otherwise. It
+  // goes out as a key frame of its own right before the frame itself.
+  virtual int
+  getHeaderSize() {
+    return 0;
+  }
+
+  virtual unsigned char*
+  getHeaderData() {
+    return NULL;
+  }
+
+  // What the last encoded frame needs in order to be decoded.
+  virtual Reference
+  getReference() {
+    return REFERENCE_NONE;
+  }
+
+  // Makes the next frame a key frame.
+  virtual void
+  requestKeyFrame() {
+  }
+
+  // Whether frames other than key frames depend on the previous one, as
+  // currently configured, so that none of them can be skipped or sent
+  // again.
+  virtual bool
+  isIncremental() {
+    return false;
+  }
+
+  // Byte offsets of the red, green, blue and alpha channels within a
+  // pixel. The alpha offset is negative if there's no alpha channel.
+  struct Layout {
+    int r;
+    int g;
+    int b;
+    int a;
+  };
+
+  static bool
+  getLayout(Minicap::Format format, Layout* layout) {
+    switch (format) {
+    case Minicap::FORMAT_RGBA_8888:
+      *layout = { 0, 1, 2, 3 };
+      return true;
+    case Minicap::FORMAT_RGBX_8888:
+    case Minicap::FORMAT_RGB_888:
+      *layout = { 0, 1, 2, -1 };
+      return true;
+    case Minicap::FORMAT_BGRA_8888:
+      *layout = { 2, 1, 0, 3 };
+      return true;
+    default:
+      return false;
+    }
+  }
+};
+
+#endif
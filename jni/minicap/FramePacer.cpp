@@ -0,0 +1,163 @@
+#include "FramePacer.hpp"
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "util/debug.h"
+
+// std::chrono::milliseconds takes it by reference.
+const unsigned int FramePacer::MAX_LAG_MS;
+
+FramePacer::FramePacer()
+  : mFd(-1),
+    mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    mPeriodNs(0),
+    mConstant(false),
+    mStarted(false),
+    mSlot(0) {
+}
+
+FramePacer::~FramePacer() {
+  if (mFd >= 0) {
+    ::close(mFd);
+  }
+
+  if (mEventFd >= 0) {
+    ::close(mEventFd);
+  }
+}
+
+bool
+FramePacer::setRate(double rate) {
+  if (rate < 0) {
+    return false;
+  }
+
+  // The timer runs on the same clock as Clock, i.e. CLOCK_MONOTONIC.
+  if (rate > 0 && mFd < 0) {
+    if ((mFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+      MCERROR("Unable to create timer");
+      return false;
+    }
+  }
+
+  mPeriodNs = rate > 0 ? 1e9 / rate : 0;
+  mStarted = false;
+
+  return true;
+}
+
+void
+FramePacer::setConstant(bool constant) {
+  mConstant = constant;
+}
+
+bool
+FramePacer::isEnabled() const {
+  return mPeriodNs > 0;
+}
+
+bool
+FramePacer::isConstant() const {
+  return mConstant && isEnabled();
+}
+
+void
+FramePacer::waitForNextFrame(Clock::time_point availableAt) {
+  if (!isEnabled()) {
+    return;
+  }
+
+  // Outside of constant mode, the grid starts over with frames that come
+  // after a pause, as they'd otherwise be due right away. Frames that
+  // arrive on time keep to the grid, which makes up for the ones that
+  // took a bit longer to send.
+  if (!mStarted || (!mConstant && availableAt >= getDeadline(mSlot + 1))) {
+    mStarted = true;
+    mOrigin = availableAt;
+    mSlot = 0;
+  }
+
+  Clock::time_point deadline = getDeadline(++mSlot);
+  Clock::time_point now = Clock::now();
+
+  if (deadline > now) {
+    sleepUntil(deadline);
+  }
+  else if (now - deadline > std::chrono::milliseconds(MAX_LAG_MS)) {
+    // E.g. nobody was there to take the frames for a while.
+    MCINFO("Frame pacing is %lld ms behind, starting over",
+      static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        now - deadline).count()));
+    mOrigin = now;
+    mSlot = 0;
+  }
+}
+
+void
+FramePacer::interrupt() {
+  uint64_t value = 1;
+  write(mEventFd, &value, sizeof(value));
+}
+
+void
+FramePacer::reset() {
+  mStarted = false;
+}
+
+bool
+FramePacer::isBehind() const {
+  return mStarted && Clock::now() >= getDeadline(mSlot + 1);
+}
+
+FramePacer::Clock::time_point
+FramePacer::getDeadline(uint64_t slot) const {
+  // Computing each deadline from the origin keeps rounding errors from
+  // adding up.
+  return mOrigin + std::chrono::nanoseconds(llround(slot * mPeriodNs));
+}
+
+void
+FramePacer::sleepUntil(Clock::time_point deadline) {
+  long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    deadline.time_since_epoch()).count();
+
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+
+  if (timerfd_settime(mFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    MCERROR("Unable to set timer");
+    return;
+  }
+
+  struct pollfd fds[2];
+  fds[0].fd = mFd;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  fds[1].fd = mEventFd;
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+
+  if (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR) {
+      MCERROR("Unable to wait for timer");
+    }
+
+    return;
+  }
+
+  uint64_t value;
+
+  if (fds[0].revents & POLLIN) {
+    read(mFd, &value, sizeof(value));
+  }
+
+  if (fds[1].revents & POLLIN) {
+    read(mEventFd, &value, sizeof(value));
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef MINICAP_FRAME_PACER_HPP
+#define MINICAP_FRAME_PACER_HPP
+
+#include <chrono>
+
+#include <stdint.h>
+
+// Limits the frame rate by sleeping until the next frame is due. Frames
+// are due on a fixed grid of absolute deadlines rather than one period
+// after the previous frame, so that the rate doesn't drift when sending
+// takes a while or the period isn't a whole number of milliseconds.
+//
+// In constant mode, every deadline is meant to get a frame, and the
+// caller sends the previous frame again if there's no new one. The grid
+// then never restarts, which makes the output usable for recordings
+// without any timestamps.
+class FramePacer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Constant mode gives up catching up once it's this far behind.
+  static const unsigned int MAX_LAG_MS = 1000;
+
+  FramePacer();
+
+  ~FramePacer();
+
+  // Sets the frame rate, or disables pacing with 0.
+  bool
+  setRate(double rate);
+
+  void
+  setConstant(bool constant);
+
+  bool
+  isEnabled() const;
+
+  bool
+  isConstant() const;
+
+  // Call after sending a frame that became available at the given time.
+  // Sleeps until the next frame is due, or until interrupted by a signal.
+  void
+  waitForNextFrame(Clock::time_point availableAt);
+
+  // Cuts the current wait short. May be called from any thread.
+  void
+  interrupt();
+
+  // Starts over with the next frame, e.g. after pacing was suspended for
+  // a while.
+  void
+  reset();
+
+  // Whether the frame after the one we've just waited for is already due,
+  // i.e. constant mode has fallen behind. It's then best to catch up by
+  // sending the previous frame again rather than encoding a new one.
+  bool
+  isBehind() const;
+
+private:
+  int mFd;
+  int mEventFd;
+  double mPeriodNs;
+  bool mConstant;
+  bool mStarted;
+  Clock::time_point mOrigin;
+  uint64_t mSlot;
+
+  Clock::time_point
+  getDeadline(uint64_t slot) const;
+
+  void
+  sleepUntil(Clock::time_point deadline);
+};
+
+#endif
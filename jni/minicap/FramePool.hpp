@@ -0,0 +1,34 @@
+#ifndef MINICAP_FRAME_POOL_HPP
+#define MINICAP_FRAME_POOL_HPP
+
+#include <memory>
+#include <vector>
+
+#include "EncodedFrame.hpp"
+
+// Recycles encoded frame buffers so that we don't have to allocate a new
+// one for every frame. A frame is free once the pool holds the only
+// reference to it, i.e. all clients are done sending it. Only meant to be
+// used from a single thread.
+class FramePool {
+public:
+  std::shared_ptr<EncodedFrame>
+  acquire() {
+    for (auto& frame: mFrames) {
+      // Clients only ever drop references, so once we see a count of one
+      // nobody else can grab the frame before we do.
+      if (frame.use_count() == 1) {
+        return frame;
+      }
+    }
+
+    mFrames.push_back(std::make_shared<EncodedFrame>());
+
+    return mFrames.back();
+  }
+
+private:
+  std::vector<std::shared_ptr<EncodedFrame>> mFrames;
+};
+
+#endif
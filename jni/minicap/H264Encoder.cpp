@@ -0,0 +1,301 @@
+#include "H264Encoder.hpp"
+
+#include <string.h>
+
+#include "util/debug.h"
+
+// Only a hint for rate control, as we never know when the next frame is
+// coming.
+#define NOMINAL_FRAME_RATE 30
+
+H264Encoder::H264Encoder()
+  : mTjHandle(tjInitCompress()),
+    mEncoder(NULL),
+    mInitialized(false),
+    mWidth(0),
+    mHeight(0),
+    mQuality(0),
+    mEncodedSize(0),
+    mKeyFrame(true),
+    mKeyFrameRequested(false),
+    mTimestamp(0) {
+  if (WelsCreateSVCEncoder(&mEncoder) != 0) {
+    mEncoder = NULL;
+  }
+}
+
+H264Encoder::~H264Encoder() {
+  uninitialize();
+
+  if (mEncoder != NULL) {
+    WelsDestroySVCEncoder(mEncoder);
+  }
+
+  tjDestroy(mTjHandle);
+}
+
+FrameEncoder::Codec
+H264Encoder::getCodec() {
+  return CODEC_H264;
+}
+
+bool
+H264Encoder::reserveData(uint32_t width, uint32_t height) {
+  if (mEncoder == NULL) {
+    MCERROR("Unable to create H.264 encoder");
+    return false;
+  }
+
+  // The I420 picture we feed the encoder, with room for odd sizes.
+  size_t pictureSize = tjBufSizeYUV2(width, 1, height, TJSAMP_420);
+
+  if (pictureSize <= mPicture.size()) {
+    return true;
+  }
+
+  // Even a key frame is practically never larger than the raw picture.
+  MCINFO("Allocating %zu bytes for H.264 encoder", pictureSize * 2);
+
+  mPicture.resize(pictureSize);
+  mEncodedData.resize(pictureSize);
+
+  return true;
+}
+
+bool
+H264Encoder::encode(Minicap::Frame* frame, unsigned int quality) {
+  if (!reserveData(frame->width, frame->height)) {
+    return false;
+  }
+
+  if (!mInitialized || frame->width != mWidth || frame->height != mHeight) {
+    uninitialize();
+
+    if (!initialize(frame->width, frame->height, quality)) {
+      return false;
+    }
+  }
+  else if (quality != mQuality && !setQuality(quality)) {
+    return false;
+  }
+
+  int pixelFormat = convertFormat(frame->format);
+  if (pixelFormat < 0) {
+    MCERROR("Unsupported pixel format for H.264");
+    return false;
+  }
+
+  int strides[3];
+  strides[0] = frame->width;
+  strides[1] = (frame->width + 1) / 2;
+  strides[2] = strides[1];
+
+  unsigned char* planes[3];
+  planes[0] = mPicture.data();
+  planes[1] = planes[0] + strides[0] * frame->height;
+  planes[2] = planes[1] + strides[1] * ((frame->height + 1) / 2);
+
+  // libjpeg-turbo has fast SIMD paths for the color conversion.
+  if (tjEncodeYUVPlanes(mTjHandle, (unsigned char*) frame->data, frame->width,
+      frame->stride * frame->bpp, frame->height, pixelFormat, planes, strides,
+      TJSAMP_420, TJFLAG_FASTDCT) != 0) {
+    MCERROR("Unable to convert frame to I420: %s", tjGetErrorStr());
+    return false;
+  }
+
+  SSourcePicture picture;
+  memset(&picture, 0, sizeof(picture));
+  picture.iColorFormat = videoFormatI420;
+  picture.iPicWidth = frame->width;
+  picture.iPicHeight = frame->height;
+  picture.uiTimeStamp = mTimestamp;
+
+  for (int i = 0; i < 3; ++i) {
+    picture.iStride[i] = strides[i];
+    picture.pData[i] = planes[i];
+  }
+
+  mTimestamp += 1000 / NOMINAL_FRAME_RATE;
+
+  if (mKeyFrameRequested) {
+    mEncoder->ForceIntraFrame(true);
+    mKeyFrameRequested = false;
+  }
+
+  SFrameBSInfo info;
+  memset(&info, 0, sizeof(info));
+
+  if (mEncoder->EncodeFrame(&picture, &info) != cmResultSuccess) {
+    MCERROR("Unable to encode H.264 frame");
+    return false;
+  }
+
+  mKeyFrame = info.eFrameType == videoFrameTypeIDR;
+  mEncodedSize = 0;
+
+  if (info.eFrameType == videoFrameTypeSkip) {
+    return true;
+  }
+
+  // Each layer's NAL units are contiguous, start codes included.
+  for (int i = 0; i < info.iLayerNum; ++i) {
+    SLayerBSInfo& layer = info.sLayerInfo[i];
+
+    size_t layerSize = 0;
+    for (int j = 0; j < layer.iNalCount; ++j) {
+      layerSize += layer.pNalLengthInByte[j];
+    }
+
+    if (mEncodedSize + layerSize > mEncodedData.size()) {
+      mEncodedData.resize(mEncodedSize + layerSize);
+    }
+
+    memcpy(mEncodedData.data() + mEncodedSize, layer.pBsBuf, layerSize);
+    mEncodedSize += layerSize;
+  }
+
+  return true;
+}
+
+int
+H264Encoder::getEncodedSize() {
+  return mEncodedSize;
+}
+
+unsigned char*
+H264Encoder::getEncodedData() {
+  return mEncodedData.data();
+}
+
+FrameEncoder::Reference
+H264Encoder::getReference() {
+  return mKeyFrame ? REFERENCE_NONE : REFERENCE_PREVIOUS_FRAME;
+}
+
+void
+H264Encoder::requestKeyFrame() {
+  mKeyFrameRequested = true;
+}
+
+bool
+H264Encoder::isIncremental() {
+  return true;
+}
+
+bool
+H264Encoder::initialize(uint32_t width, uint32_t height, unsigned int quality) {
+  SEncParamExt& params = mParams;
+  mEncoder->GetDefaultParams(&params);
+
+  params.iUsageType = SCREEN_CONTENT_REAL_TIME;
+  params.iPicWidth = width;
+  params.iPicHeight = height;
+  params.fMaxFrameRate = NOMINAL_FRAME_RATE;
+  params.iRCMode = RC_QUALITY_MODE;
+  params.iTargetBitrate = width * height * 3;
+  params.iMaxBitrate = UNSPECIFIED_BIT_RATE;
+
+  // Quiet screens end up well below the ceiling anyway.
+  params.iMaxQp = getMaxQp(quality);
+  params.iMinQp = 10;
+
+  // We only encode frames that somebody wants, so don't let rate control
+  // throw them away.
+  params.bEnableFrameSkip = false;
+
+  // Baseline, no B-frames, and a single reference frame so that each
+  // frame only depends on the one before it.
+  params.iEntropyCodingModeFlag = 0;
+  params.iNumRefFrame = 1;
+  params.bEnableLongTermReference = false;
+  params.uiIntraPeriod = KEY_FRAME_INTERVAL;
+  params.eSpsPpsIdStrategy = CONSTANT_ID;
+  params.iTemporalLayerNum = 1;
+  params.iSpatialLayerNum = 1;
+  params.iMultipleThreadIdc = 1;
+  params.bEnableDenoise = false;
+  params.bEnableSceneChangeDetect = true;
+  params.bEnableBackgroundDetection = true;
+  params.bEnableAdaptiveQuant = false;
+
+  SSpatialLayerConfig& layer = params.sSpatialLayers[0];
+  layer.uiProfileIdc = PRO_BASELINE;
+  layer.iVideoWidth = width;
+  layer.iVideoHeight = height;
+  layer.fFrameRate = NOMINAL_FRAME_RATE;
+  layer.iSpatialBitrate = params.iTargetBitrate;
+  layer.iMaxSpatialBitrate = UNSPECIFIED_BIT_RATE;
+  layer.sSliceArgument.uiSliceMode = SM_SINGLE_SLICE;
+
+  // The I420 conversion is full range BT.601, as in JPEG.
+  layer.bVideoSignalTypePresent = true;
+  layer.uiVideoFormat = VF_UNDEF;
+  layer.bFullRange = true;
+  layer.bColorDescriptionPresent = true;
+  layer.uiColorPrimaries = CP_BT470BG;
+  layer.uiTransferCharacteristics = TRC_BT470BG;
+  layer.uiColorMatrix = CM_BT470BG;
+
+  if (mEncoder->InitializeExt(&params) != cmResultSuccess) {
+    MCERROR("Unable to initialize H.264 encoder");
+    return false;
+  }
+
+  int videoFormat = videoFormatI420;
+  mEncoder->SetOption(ENCODER_OPTION_DATAFORMAT, &videoFormat);
+
+  mInitialized = true;
+  mWidth = width;
+  mHeight = height;
+  mQuality = quality;
+
+  // The first frame is a key frame anyway.
+  mKeyFrameRequested = false;
+
+  return true;
+}
+
+bool
+H264Encoder::setQuality(unsigned int quality) {
+  mParams.iMaxQp = getMaxQp(quality);
+
+  // Only resolution changes and the like make the encoder reset itself,
+  // everything else applies from the next frame on.
+  if (mEncoder->SetOption(ENCODER_OPTION_SVC_ENCODE_PARAM_EXT, &mParams) != cmResultSuccess) {
+    MCERROR("Unable to change H.264 quality");
+    return false;
+  }
+
+  mQuality = quality;
+
+  return true;
+}
+
+int
+H264Encoder::getMaxQp(unsigned int quality) {
+  return 20 + (100 - quality) * 31 / 100;
+}
+
+void
+H264Encoder::uninitialize() {
+  if (mInitialized) {
+    mEncoder->Uninitialize();
+    mInitialized = false;
+  }
+}
+
+int
+H264Encoder::convertFormat(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_8888:
+    return TJPF_RGBA;
+  case Minicap::FORMAT_RGBX_8888:
+    return TJPF_RGBX;
+  case Minicap::FORMAT_RGB_888:
+    return TJPF_RGB;
+  case Minicap::FORMAT_BGRA_8888:
+    return TJPF_BGRA;
+  default:
+    return -1;
+  }
+}
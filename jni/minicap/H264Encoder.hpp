@@ -0,0 +1,88 @@
+#ifndef MINICAP_H264_ENCODER_HPP
+#define MINICAP_H264_ENCODER_HPP
+
+#include <vector>
+
+#include <turbojpeg.h>
+#include <wels/codec_api.h>
+
+#include "FrameEncoder.hpp"
+#include "Minicap.hpp"
+
+// Encodes frames as a constrained baseline H.264 stream with OpenH264,
+// tuned for screen content. Every frame is a complete Annex B access unit,
+// and P frames are relative to the previous frame. Key frames come with
+// their SPS and PPS, so decoding can start at any of them.
+//
+// Only available when OpenH264 is found at build time.
+class H264Encoder: public FrameEncoder {
+public:
+  // Frames between key frames. Clients may have to catch up on everything
+  // since the last key frame, so this shouldn't be too long.
+  static const unsigned int KEY_FRAME_INTERVAL = 120;
+
+  H264Encoder();
+
+  ~H264Encoder();
+
+  Codec
+  getCodec();
+
+  bool
+  reserveData(uint32_t width, uint32_t height);
+
+  bool
+  encode(Minicap::Frame* frame, unsigned int quality);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+  Reference
+  getReference();
+
+  void
+  requestKeyFrame();
+
+  bool
+  isIncremental();
+
+private:
+  tjhandle mTjHandle;
+  ISVCEncoder* mEncoder;
+  bool mInitialized;
+  uint32_t mWidth;
+  uint32_t mHeight;
+  unsigned int mQuality;
+  // What the encoder was last set up with, so that the quality can be
+  // changed on the fly.
+  SEncParamExt mParams;
+  std::vector<unsigned char> mPicture;
+  std::vector<unsigned char> mEncodedData;
+  size_t mEncodedSize;
+  bool mKeyFrame;
+  bool mKeyFrameRequested;
+  unsigned long long mTimestamp;
+
+  bool
+  initialize(uint32_t width, uint32_t height, unsigned int quality);
+
+  void
+  uninitialize();
+
+  // Changes the QP ceiling without starting over, i.e. without forcing a
+  // key frame, as the quality may change from one frame to the next.
+  bool
+  setQuality(unsigned int quality);
+
+  // Maps the JPEG style quality to a QP ceiling.
+  static int
+  getMaxQp(unsigned int quality);
+
+  static int
+  convertFormat(Minicap::Format format);
+};
+
+#endif
@@ -1,40 +1,246 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <stdexcept>
 
+#include <jerror.h>
+
 #include "JpgEncoder.hpp"
 #include "util/debug.h"
 
-JpgEncoder::JpgEncoder(unsigned int prePadding, unsigned int postPadding)
-  : mTjHandle(tjInitCompress()),
+// How much the chroma of neighboring pixels has to differ for there to be
+// a sharp edge, like around colored text, as opposed to the gradual
+// changes of photos and video.
+#define CHROMA_EDGE_THRESHOLD 64
+
+// Once sharp chroma edges in a direction make up more than this many
+// sampled pixels in a thousand, we keep full chroma resolution in that
+// direction. Going back takes less than the lower limit, so that we don't
+// keep switching back and forth.
+#define CHROMA_DETAIL_HIGH 5
+#define CHROMA_DETAIL_LOW 2
+
+// Only every n-th row is sampled.
+#define CHROMA_SAMPLE_ROW_INTERVAL 8
+
+// The standard luma and chroma tables from Annex K of the JPEG spec.
+static const unsigned int STD_LUMA_TABLE[DCTSIZE2] = {
+  16, 11, 10, 16,  24,  40,  51,  61,
+  12, 12, 14, 19,  26,  58,  60,  55,
+  14, 13, 16, 24,  40,  57,  69,  56,
+  14, 17, 22, 29,  51,  87,  80,  62,
+  18, 22, 37, 56,  68, 109, 103,  77,
+  24, 35, 55, 64,  81, 104, 113,  92,
+  49, 64, 78, 87, 103, 121, 120, 101,
+  72, 92, 95, 98, 112, 100, 103,  99,
+};
+
+static const unsigned int STD_CHROMA_TABLE[DCTSIZE2] = {
+  17, 18, 24, 47, 99, 99, 99, 99,
+  18, 21, 26, 66, 99, 99, 99, 99,
+  24, 26, 56, 99, 99, 99, 99, 99,
+  47, 66, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+// Quantization tables for screen content, in natural order, scaled by
+// quality just like the standard ones. They rise slowly towards higher
+// frequencies, so that edges don't ring. On typical UI screenshots they
+// need about 9% (text) and 11% (flat, at high quality) fewer bytes than
+// the standard tables for the same SSIM. Flatter chroma tables didn't
+// help, so chroma keeps the standard one.
+static const unsigned int TEXT_LUMA_TABLE[DCTSIZE2] = {
+  16, 18, 20, 22, 24, 26, 28, 30,
+  18, 20, 22, 24, 26, 28, 30, 32,
+  20, 22, 24, 26, 28, 30, 32, 34,
+  22, 24, 26, 28, 30, 32, 34, 36,
+  24, 26, 28, 30, 32, 34, 36, 38,
+  26, 28, 30, 32, 34, 36, 38, 40,
+  28, 30, 32, 34, 36, 38, 40, 42,
+  30, 32, 34, 36, 38, 40, 42, 44,
+};
+
+static const unsigned int FLAT_LUMA_TABLE[DCTSIZE2] = {
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+  16, 16, 16, 16, 16, 16, 16, 16,
+};
+
+JpgEncoder::JpgEncoder(bool abbreviated)
+  : mAbbreviated(abbreviated),
+    mQuantTables(QUANT_TABLES_PHOTO),
     mSubsampling(TJSAMP_420),
-    mEncodedData(NULL),
-    mPrePadding(prePadding),
-    mPostPadding(postPadding),
+    mAdaptiveSubsampling(false),
+    mQuality(-1),
+    mBoostQuality(-1),
+    mBoosted(false),
+    mNewTables(false),
     mMaxWidth(0),
-    mMaxHeight(0)
+    mMaxHeight(0),
+    mEncodedData(NULL),
+    mEncodedCapacity(0),
+    mEncodedSize(0),
+    mTablesSize(0)
 {
+  mCompress.err = jpeg_std_error(&mErrorManager.pub);
+  mErrorManager.pub.error_exit = onError;
+
+  jpeg_create_compress(&mCompress);
+
+  mDestinationManager.pub.init_destination = initDestination;
+  mDestinationManager.pub.empty_output_buffer = emptyOutputBuffer;
+  mDestinationManager.pub.term_destination = termDestination;
+  mCompress.dest = &mDestinationManager.pub;
+
+  // The defaults depend on the input color space, but all the ones we
+  // support end up as YCbCr with 4:2:0 subsampling, matching mSubsampling.
+  mCompress.in_color_space = JCS_EXT_RGBA;
+  mCompress.input_components = 4;
+  jpeg_set_defaults(&mCompress);
+  mCompress.dct_method = JDCT_IFAST;
 }
 
 JpgEncoder::~JpgEncoder() {
+  jpeg_destroy_compress(&mCompress);
   tjFree(mEncodedData);
 }
 
+FrameEncoder::Codec
+JpgEncoder::getCodec() {
+  return mAbbreviated ? CODEC_JPEG_ABBREVIATED : CODEC_JPEG;
+}
+
+bool
+JpgEncoder::setOption(const char* name, const char* value) {
+  if (strcmp(name, "tables") == 0) {
+    if (strcmp(value, "photo") == 0) {
+      mQuantTables = QUANT_TABLES_PHOTO;
+    }
+    else if (strcmp(value, "text") == 0) {
+      mQuantTables = QUANT_TABLES_TEXT;
+    }
+    else if (strcmp(value, "flat") == 0) {
+      mQuantTables = QUANT_TABLES_FLAT;
+    }
+    else {
+      return false;
+    }
+
+    // Make sure the tables get rebuilt.
+    mQuality = -1;
+
+    return true;
+  }
+
+  if (strcmp(name, "subsampling") == 0) {
+    int subsampling;
+
+    mAdaptiveSubsampling = false;
+
+    if (strcmp(value, "420") == 0) {
+      subsampling = TJSAMP_420;
+    }
+    else if (strcmp(value, "422") == 0) {
+      subsampling = TJSAMP_422;
+    }
+    else if (strcmp(value, "444") == 0) {
+      subsampling = TJSAMP_444;
+    }
+    else if (strcmp(value, "gray") == 0) {
+      subsampling = TJSAMP_GRAY;
+    }
+    else if (strcmp(value, "auto") == 0) {
+      subsampling = TJSAMP_420;
+      mAdaptiveSubsampling = true;
+    }
+    else {
+      return false;
+    }
+
+    setSubsampling(subsampling);
+
+    return true;
+  }
+
+  return false;
+}
+
+void
+JpgEncoder::setBoostQuality(int quality) {
+  if (quality != mBoostQuality) {
+    mBoostQuality = quality;
+
+    // Make sure the tables get rebuilt.
+    mQuality = -1;
+  }
+}
+
+bool
+JpgEncoder::encodeBoosted(Minicap::Frame* frame, unsigned int quality) {
+  mBoosted = mBoostQuality >= 0;
+  bool encoded = encode(frame, quality);
+  mBoosted = false;
+  return encoded;
+}
+
 bool
 JpgEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
-  unsigned char* offset = getEncodedData();
-
-  return 0 == tjCompress2(
-    mTjHandle,
-    (unsigned char*) frame->data,
-    frame->width,
-    frame->stride * frame->bpp,
-    frame->height,
-    convertFormat(frame->format),
-    &offset,
-    &mEncodedSize,
-    mSubsampling,
-    quality,
-    TJFLAG_FASTDCT | TJFLAG_NOREALLOC
-  );
+  mCompress.image_width = frame->width;
+  mCompress.image_height = frame->height;
+  mCompress.in_color_space = convertFormat(frame->format);
+  mCompress.input_components = frame->bpp;
+
+  mRows.resize(frame->height);
+  for (uint32_t y = 0; y < frame->height; ++y) {
+    mRows[y] = (JSAMPROW) frame->data + y * frame->stride * frame->bpp;
+  }
+
+  if (mAdaptiveSubsampling) {
+    setSubsampling(chooseSubsampling(frame));
+  }
+
+  mNewTables = false;
+
+  if (static_cast<int>(quality) != mQuality) {
+    setQuality(quality);
+
+    if (mAbbreviated) {
+      // Have libjpeg find the best Huffman tables for this frame, then
+      // make sure that they can also code whatever later frames might
+      // need.
+      mCompress.optimize_coding = TRUE;
+      bool compressed = compress(true);
+      mCompress.optimize_coding = FALSE;
+
+      if (!compressed) {
+        return false;
+      }
+
+      for (int i = 0; i < 2; ++i) {
+        completeHuffmanTable(mCompress.dc_huff_tbl_ptrs[i], false);
+        completeHuffmanTable(mCompress.ac_huff_tbl_ptrs[i], true);
+      }
+
+      if (!writeTables()) {
+        return false;
+      }
+
+      mNewTables = true;
+    }
+
+    mQuality = quality;
+  }
+
+  return compress(!mAbbreviated);
 }
 
 int
@@ -44,26 +250,39 @@ JpgEncoder::getEncodedSize() {
 
 unsigned char*
 JpgEncoder::getEncodedData() {
-  return mEncodedData + mPrePadding;
+  return mEncodedData;
+}
+
+int
+JpgEncoder::getHeaderSize() {
+  return mNewTables ? mTablesSize : 0;
+}
+
+unsigned char*
+JpgEncoder::getHeaderData() {
+  return mTablesData;
+}
+
+FrameEncoder::Reference
+JpgEncoder::getReference() {
+  // Abbreviated frames can't be decoded without the tables, which are
+  // sent as a key frame of their own.
+  return mAbbreviated ? REFERENCE_KEY_FRAME : REFERENCE_NONE;
 }
 
 bool
 JpgEncoder::reserveData(uint32_t width, uint32_t height) {
   if (width == mMaxWidth && height == mMaxHeight) {
-    return 0;
+    return true;
   }
 
   tjFree(mEncodedData);
 
-  unsigned long maxSize = mPrePadding + mPostPadding + tjBufSize(
-    width,
-    height,
-    mSubsampling
-  );
+  mEncodedCapacity = getMaxEncodedSize(width, height);
 
-  MCINFO("Allocating %ld bytes for JPG encoder", maxSize);
+  MCINFO("Allocating %ld bytes for JPG encoder", mEncodedCapacity);
 
-  mEncodedData = tjAlloc(maxSize);
+  mEncodedData = tjAlloc(mEncodedCapacity);
 
   if (mEncodedData == NULL) {
     return false;
@@ -75,18 +294,358 @@ JpgEncoder::reserveData(uint32_t width, uint32_t height) {
   return true;
 }
 
+size_t
+JpgEncoder::getMaxEncodedSize(uint32_t width, uint32_t height) {
+  // Adaptive subsampling may pick 4:4:4 for any frame.
+  return tjBufSize(
+    width,
+    height,
+    mAdaptiveSubsampling ? TJSAMP_444 : mSubsampling
+  );
+}
+
+void
+JpgEncoder::setQuality(int quality) {
+  addQuantTables(0, quality);
+
+  if (mBoostQuality >= 0) {
+    addQuantTables(2, mBoostQuality);
+  }
+}
+
+// Adds the luma and chroma tables for the quality at the given slot and
+// the one after it.
+void
+JpgEncoder::addQuantTables(int slot, int quality) {
+  int scale = jpeg_quality_scaling(quality);
+
+  const unsigned int* luma = STD_LUMA_TABLE;
+  switch (mQuantTables) {
+  case QUANT_TABLES_PHOTO:
+    break;
+  case QUANT_TABLES_TEXT:
+    luma = TEXT_LUMA_TABLE;
+    break;
+  case QUANT_TABLES_FLAT:
+    luma = FLAT_LUMA_TABLE;
+    break;
+  }
+
+  jpeg_add_quant_table(&mCompress, slot, luma, scale, TRUE);
+  jpeg_add_quant_table(&mCompress, slot + 1, STD_CHROMA_TABLE, scale, TRUE);
+}
+
+void
+JpgEncoder::setSubsampling(int subsampling) {
+  if (subsampling == TJSAMP_GRAY) {
+    if (mCompress.jpeg_color_space != JCS_GRAYSCALE) {
+      jpeg_set_colorspace(&mCompress, JCS_GRAYSCALE);
+    }
+  }
+  else {
+    if (mCompress.jpeg_color_space != JCS_YCbCr) {
+      jpeg_set_colorspace(&mCompress, JCS_YCbCr);
+    }
+
+    // Chroma always stays at 1x1, the luma factors decide.
+    mCompress.comp_info[0].h_samp_factor = subsampling == TJSAMP_444 ? 1 : 2;
+    mCompress.comp_info[0].v_samp_factor = subsampling == TJSAMP_420 ? 2 : 1;
+  }
+
+  mSubsampling = subsampling;
+}
+
+// Picks the subsampling for the frame by looking for sharp chroma edges
+// in a sample of its rows. Chroma is approximated by the differences of
+// red and blue to green, which is close enough for finding edges.
 int
+JpgEncoder::chooseSubsampling(Minicap::Frame* frame) {
+  Layout layout;
+  if (!getLayout(frame->format, &layout) || frame->width < 2 || frame->height < 2) {
+    return mSubsampling;
+  }
+
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t rowSize = frame->stride * frame->bpp;
+  unsigned long samples = 0;
+  unsigned long horizontalEdges = 0;
+  unsigned long verticalEdges = 0;
+
+  for (uint32_t y = 0; y + 1 < frame->height; y += CHROMA_SAMPLE_ROW_INTERVAL) {
+    const unsigned char* row = data + y * rowSize;
+    const unsigned char* below = row + rowSize;
+
+    for (uint32_t x = 0; x + 1 < frame->width; ++x) {
+      const unsigned char* p = row + x * frame->bpp;
+      const unsigned char* right = p + frame->bpp;
+      const unsigned char* down = below + x * frame->bpp;
+
+      int u = p[layout.b] - p[layout.g];
+      int v = p[layout.r] - p[layout.g];
+
+      if (abs(right[layout.b] - right[layout.g] - u) +
+          abs(right[layout.r] - right[layout.g] - v) > CHROMA_EDGE_THRESHOLD) {
+        horizontalEdges += 1;
+      }
+
+      if (abs(down[layout.b] - down[layout.g] - u) +
+          abs(down[layout.r] - down[layout.g] - v) > CHROMA_EDGE_THRESHOLD) {
+        verticalEdges += 1;
+      }
+    }
+
+    samples += frame->width - 1;
+  }
+
+  // Horizontal detail can only be kept with 4:4:4, vertical detail
+  // alone with 4:2:2 as well.
+  bool keepHorizontal = horizontalEdges * 1000 > samples *
+    (mSubsampling == TJSAMP_444 ? CHROMA_DETAIL_LOW : CHROMA_DETAIL_HIGH);
+
+  bool keepVertical = verticalEdges * 1000 > samples *
+    (mSubsampling != TJSAMP_420 ? CHROMA_DETAIL_LOW : CHROMA_DETAIL_HIGH);
+
+  if (keepHorizontal) {
+    return TJSAMP_444;
+  }
+
+  if (keepVertical) {
+    return TJSAMP_422;
+  }
+
+  return TJSAMP_420;
+}
+
+bool
+JpgEncoder::compress(bool withTables) {
+  mDestinationManager.data = getEncodedData();
+  mDestinationManager.capacity = mEncodedCapacity;
+
+  if (setjmp(mErrorManager.jump)) {
+    jpeg_abort_compress(&mCompress);
+    return false;
+  }
+
+  int slot = mBoosted ? 2 : 0;
+  for (int i = 0; i < mCompress.num_components; ++i) {
+    mCompress.comp_info[i].quant_tbl_no = i == 0 ? slot : slot + 1;
+  }
+
+  // Without tables, only the ones that haven't been written out with
+  // writeTables() yet are included.
+  jpeg_start_compress(&mCompress, withTables ? TRUE : FALSE);
+
+  while (mCompress.next_scanline < mCompress.image_height) {
+    jpeg_write_scanlines(&mCompress, &mRows[mCompress.next_scanline],
+      mCompress.image_height - mCompress.next_scanline);
+  }
+
+  jpeg_finish_compress(&mCompress);
+
+  mEncodedSize = mDestinationManager.size;
+
+  return true;
+}
+
+bool
+JpgEncoder::writeTables() {
+  mDestinationManager.data = mTablesData;
+  mDestinationManager.capacity = MAX_TABLES_SIZE;
+
+  if (setjmp(mErrorManager.jump)) {
+    jpeg_abort_compress(&mCompress);
+    return false;
+  }
+
+  // Tables are only written if they haven't been already, so make sure
+  // they're all included.
+  jpeg_suppress_tables(&mCompress, FALSE);
+  jpeg_write_tables(&mCompress);
+
+  mTablesSize = mDestinationManager.size;
+
+  return true;
+}
+
+// Turns a table that has been optimized for a single frame into one that
+// has a code for every symbol, so that it can be reused for any frame.
+// Symbols that were used keep roughly the same code length, the rest get
+// the longest codes. This is the algorithm from section K.2 of the JPEG
+// spec, just like libjpeg's own jpeg_gen_optimal_table().
+void
+JpgEncoder::completeHuffmanTable(JHUFF_TBL* table, bool ac) {
+  long freq[257] = {0};
+  int codesize[257] = {0};
+  int others[257];
+  int bits[33] = {0};
+
+  // Derive frequencies from the code lengths of the existing table.
+  int p = 0;
+  for (int length = 1; length <= 16; ++length) {
+    for (int i = 0; i < table->bits[length]; ++i) {
+      freq[table->huffval[p++]] = 1L << (16 - length);
+    }
+  }
+
+  // Make sure all symbols that baseline 8-bit JPEG may use have a code.
+  if (ac) {
+    freq[0x00] = freq[0x00] > 0 ? freq[0x00] : 1;
+    freq[0xF0] = freq[0xF0] > 0 ? freq[0xF0] : 1;
+
+    for (int run = 0; run < 16; ++run) {
+      for (int size = 1; size <= 10; ++size) {
+        int symbol = (run << 4) | size;
+        freq[symbol] = freq[symbol] > 0 ? freq[symbol] : 1;
+      }
+    }
+  }
+  else {
+    for (int symbol = 0; symbol <= 11; ++symbol) {
+      freq[symbol] = freq[symbol] > 0 ? freq[symbol] : 1;
+    }
+  }
+
+  // Reserve one code point so that no code consists of all ones.
+  freq[256] = 1;
+
+  for (int i = 0; i < 257; ++i) {
+    others[i] = -1;
+  }
+
+  // Merge the two least frequent nodes until only one is left.
+  for (;;) {
+    int c1 = -1;
+    int c2 = -1;
+    long v = LONG_MAX;
+
+    for (int i = 0; i <= 256; ++i) {
+      if (freq[i] && freq[i] <= v) {
+        v = freq[i];
+        c1 = i;
+      }
+    }
+
+    v = LONG_MAX;
+    for (int i = 0; i <= 256; ++i) {
+      if (freq[i] && freq[i] <= v && i != c1) {
+        v = freq[i];
+        c2 = i;
+      }
+    }
+
+    if (c2 < 0) {
+      break;
+    }
+
+    freq[c1] += freq[c2];
+    freq[c2] = 0;
+
+    codesize[c1] += 1;
+    while (others[c1] >= 0) {
+      c1 = others[c1];
+      codesize[c1] += 1;
+    }
+
+    others[c1] = c2;
+
+    codesize[c2] += 1;
+    while (others[c2] >= 0) {
+      c2 = others[c2];
+      codesize[c2] += 1;
+    }
+  }
+
+  for (int i = 0; i <= 256; ++i) {
+    if (codesize[i]) {
+      // Can't happen with the frequencies above, as the ratio between the
+      // largest and the smallest one is way too small.
+      if (codesize[i] > 32) {
+        throw std::runtime_error("Huffman code length overflow");
+      }
+
+      bits[codesize[i]] += 1;
+    }
+  }
+
+  // JPEG limits code lengths to 16 bits.
+  int i;
+  for (i = 32; i > 16; --i) {
+    while (bits[i] > 0) {
+      int j = i - 2;
+      while (bits[j] == 0) {
+        j -= 1;
+      }
+
+      bits[i] -= 2;
+      bits[i - 1] += 1;
+      bits[j + 1] += 2;
+      bits[j] -= 1;
+    }
+  }
+
+  // Give up the reserved code point again.
+  while (bits[i] == 0) {
+    i -= 1;
+  }
+
+  bits[i] -= 1;
+
+  memset(table->bits, 0, sizeof(table->bits));
+  for (i = 1; i <= 16; ++i) {
+    table->bits[i] = bits[i];
+  }
+
+  p = 0;
+  for (i = 1; i <= 32; ++i) {
+    for (int symbol = 0; symbol <= 255; ++symbol) {
+      if (codesize[symbol] == i) {
+        table->huffval[p++] = symbol;
+      }
+    }
+  }
+}
+
+J_COLOR_SPACE
 JpgEncoder::convertFormat(Minicap::Format format) {
   switch (format) {
   case Minicap::FORMAT_RGBA_8888:
-    return TJPF_RGBA;
+    return JCS_EXT_RGBA;
   case Minicap::FORMAT_RGBX_8888:
-    return TJPF_RGBX;
+    return JCS_EXT_RGBX;
   case Minicap::FORMAT_RGB_888:
-    return TJPF_RGB;
+    return JCS_EXT_RGB;
   case Minicap::FORMAT_BGRA_8888:
-    return TJPF_BGRA;
+    return JCS_EXT_BGRA;
   default:
     throw std::runtime_error("Unsupported pixel format");
   }
 }
+
+void
+JpgEncoder::onError(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  MCERROR("Unable to encode JPEG: %s", message);
+
+  longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+}
+
+void
+JpgEncoder::initDestination(j_compress_ptr cinfo) {
+  DestinationManager* dest = reinterpret_cast<DestinationManager*>(cinfo->dest);
+  dest->pub.next_output_byte = dest->data;
+  dest->pub.free_in_buffer = dest->capacity;
+}
+
+boolean
+JpgEncoder::emptyOutputBuffer(j_compress_ptr cinfo) {
+  // Buffers are sized for the worst case, so we should never get here.
+  ERREXIT(cinfo, JERR_BUFFER_SIZE);
+  return FALSE;
+}
+
+void
+JpgEncoder::termDestination(j_compress_ptr cinfo) {
+  DestinationManager* dest = reinterpret_cast<DestinationManager*>(cinfo->dest);
+  dest->size = dest->capacity - dest->pub.free_in_buffer;
+}
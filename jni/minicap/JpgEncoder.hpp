@@ -1,40 +1,152 @@
 #ifndef MINICAP_JPG_ENCODER_HPP
 #define MINICAP_JPG_ENCODER_HPP
 
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
 #include <turbojpeg.h>
 
+#include <vector>
+
+#include "FrameEncoder.hpp"
 #include "Minicap.hpp"
 
-class JpgEncoder {
+// Encodes frames with libjpeg-turbo. In abbreviated mode, the
+// quantization and Huffman tables are left out of the frames and only
+// sent when they change, as a tables-only JPEG of their own. The Huffman
+// tables are then also optimized for the session rather than using the
+// standard ones, as they only need to be sent once.
+class JpgEncoder: public FrameEncoder {
 public:
-  JpgEncoder(unsigned int prePadding, unsigned int postPadding);
+  // Quantization table presets. The standard tables are meant for
+  // photographs, and smear text and sharp edges unless the quality is
+  // very high. The others spend more on high frequencies, and do better
+  // for screen content at the same size.
+  enum QuantTables {
+    QUANT_TABLES_PHOTO,
+    QUANT_TABLES_TEXT,
+    QUANT_TABLES_FLAT,
+  };
+
+  JpgEncoder(bool abbreviated);
 
   ~JpgEncoder();
 
+  Codec
+  getCodec();
+
+  // Known options are "tables" (photo, text or flat) and "subsampling"
+  // (420, 422, 444, gray or auto).
+  bool
+  setOption(const char* name, const char* value);
+
   bool
   encode(Minicap::Frame* frame, unsigned int quality);
 
+  // Sets a second, usually higher quality for encodeBoosted(), or
+  // disables it with -1. Abbreviated frames get the tables for both
+  // qualities at once, so that each frame may use either.
+  void
+  setBoostQuality(int quality);
+
+  // Like encode(), but with the boost quality.
+  bool
+  encodeBoosted(Minicap::Frame* frame, unsigned int quality);
+
   int
   getEncodedSize();
 
   unsigned char*
   getEncodedData();
 
+  int
+  getHeaderSize();
+
+  unsigned char*
+  getHeaderData();
+
+  Reference
+  getReference();
+
   bool
   reserveData(uint32_t width, uint32_t height);
 
+  size_t
+  getMaxEncodedSize(uint32_t width, uint32_t height);
+
 private:
-  tjhandle mTjHandle;
+  // Plenty for four quantization and four Huffman tables, even with every
+  // possible Huffman code present.
+  static const size_t MAX_TABLES_SIZE = 2048;
+
+  struct ErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+  };
+
+  struct DestinationManager {
+    struct jpeg_destination_mgr pub;
+    unsigned char* data;
+    size_t capacity;
+    size_t size;
+  };
+
+  struct jpeg_compress_struct mCompress;
+  ErrorManager mErrorManager;
+  DestinationManager mDestinationManager;
+  bool mAbbreviated;
+  QuantTables mQuantTables;
   int mSubsampling;
-  unsigned int mPrePadding;
-  unsigned int mPostPadding;
+  bool mAdaptiveSubsampling;
+  int mQuality;
+  int mBoostQuality;
+  bool mBoosted;
+  bool mNewTables;
   unsigned int mMaxWidth;
   unsigned int mMaxHeight;
   unsigned char* mEncodedData;
+  unsigned long mEncodedCapacity;
   unsigned long mEncodedSize;
+  unsigned char mTablesData[MAX_TABLES_SIZE];
+  unsigned long mTablesSize;
+  std::vector<JSAMPROW> mRows;
+
+  void
+  setQuality(int quality);
+
+  void
+  addQuantTables(int slot, int quality);
+
+  void
+  setSubsampling(int subsampling);
+
+  int
+  chooseSubsampling(Minicap::Frame* frame);
+
+  bool
+  compress(bool withTables);
+
+  bool
+  writeTables();
+
+  static void
+  completeHuffmanTable(JHUFF_TBL* table, bool ac);
 
-  static int
+  static J_COLOR_SPACE
   convertFormat(Minicap::Format format);
+
+  static void
+  onError(j_common_ptr cinfo);
+
+  static void
+  initDestination(j_compress_ptr cinfo);
+
+  static boolean
+  emptyOutputBuffer(j_compress_ptr cinfo);
+
+  static void
+  termDestination(j_compress_ptr cinfo);
 };
 
 #endif
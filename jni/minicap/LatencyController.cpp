@@ -0,0 +1,139 @@
+#include "LatencyController.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+#include "util/debug.h"
+#include "util/option.hpp"
+
+// CoDel's default, which is about how long a burst of frames takes to go
+// through.
+#define DEFAULT_INTERVAL_MS 100
+
+#define DEFAULT_QUALITY 50
+
+// Stepping down is slower than stepping up, as it tends to bring the
+// latency right back.
+#define CALM_INTERVALS 10
+
+static const char* const LEVEL_NAMES[] = {
+  "normal",
+  "shedding frames",
+  "shedding frames and lowering quality",
+};
+
+LatencyController::LatencyController()
+  : mEnabled(false),
+    mTarget(0),
+    mInterval(DEFAULT_INTERVAL_MS),
+    mQuality(DEFAULT_QUALITY),
+    mLevel(LEVEL_NORMAL),
+    mHasWindow(false),
+    mSkipped(0),
+    mCalmIntervals(0) {
+}
+
+bool
+LatencyController::set(const char* name, const char* value) {
+  long number;
+  if (!option_parse_number(value, &number)) {
+    return false;
+  }
+
+  if (strcmp(name, "target") == 0 && number > 0) {
+    mTarget = std::chrono::milliseconds(number);
+    mEnabled = true;
+    return true;
+  }
+
+  if (strcmp(name, "interval") == 0 && number > 0) {
+    mInterval = std::chrono::milliseconds(number);
+    return true;
+  }
+
+  if (strcmp(name, "quality") == 0 && number <= 100) {
+    mQuality = number;
+    return true;
+  }
+
+  return false;
+}
+
+bool
+LatencyController::parse(const char* option) {
+  return option_parse(option, *this);
+}
+
+bool
+LatencyController::isEnabled() const {
+  return mEnabled;
+}
+
+bool
+LatencyController::isShedding() const {
+  return mLevel >= LEVEL_SHED;
+}
+
+unsigned int
+LatencyController::getQuality(unsigned int quality) const {
+  return mLevel >= LEVEL_DEGRADE && quality > mQuality ? mQuality : quality;
+}
+
+void
+LatencyController::onFrameSent(Clock::time_point availableAt,
+    Clock::time_point sentAt, int skipped) {
+  if (!mEnabled) {
+    return;
+  }
+
+  Clock::duration latency = sentAt - availableAt;
+
+  if (!mHasWindow) {
+    mHasWindow = true;
+    mWindowStart = sentAt;
+    mMinLatency = latency;
+    mMaxLatency = latency;
+    mSkipped = 0;
+  }
+  else {
+    mMinLatency = std::min(mMinLatency, latency);
+    mMaxLatency = std::max(mMaxLatency, latency);
+  }
+
+  mSkipped += skipped;
+
+  if (sentAt - mWindowStart < mInterval) {
+    return;
+  }
+
+  Level level = mLevel;
+
+  // Even the best frame of the interval was late, so it's not just a
+  // burst.
+  if (mMinLatency > mTarget && mLevel < LEVEL_DEGRADE) {
+    level = static_cast<Level>(mLevel + 1);
+  }
+  // Stepping down right at the target would only make us step up again.
+  // Shedding has to stay until there's nothing left to shed, or the queue
+  // just builds up again.
+  else if (mMaxLatency < mTarget / 2 && mLevel > LEVEL_NORMAL
+      && (mLevel > LEVEL_SHED || mSkipped == 0)) {
+    if (++mCalmIntervals >= CALM_INTERVALS) {
+      level = static_cast<Level>(mLevel - 1);
+    }
+  }
+  else {
+    mCalmIntervals = 0;
+  }
+
+  if (level != mLevel) {
+    mCalmIntervals = 0;
+    MCINFO("Latency %lld ms over the last interval, now %s",
+      static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        mMinLatency).count()), LEVEL_NAMES[level]);
+    mLevel = level;
+  }
+
+  mHasWindow = false;
+}
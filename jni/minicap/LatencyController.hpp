@@ -0,0 +1,68 @@
+#ifndef MINICAP_LATENCY_CONTROLLER_HPP
+#define MINICAP_LATENCY_CONTROLLER_HPP
+
+#include <chrono>
+
+// Keeps the time from a frame becoming available to it being handed off
+// to the clients under a target, along the lines of CoDel. Latency that
+// stays over the target for a whole interval means a standing queue
+// rather than a passing burst, and makes the controller step up: first
+// to shedding frames (i.e. skipping all but the latest pending one), then
+// to a lower quality as well. It steps down again once the latency has
+// stayed well under the target for a while, and shedding is no longer
+// needed.
+class LatencyController {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Level {
+    LEVEL_NORMAL,
+    LEVEL_SHED,
+    LEVEL_DEGRADE,
+  };
+
+  LatencyController();
+
+  // Sets an option by name. Known options are "target" (in milliseconds,
+  // enables the controller), "interval" (in milliseconds) and "quality"
+  // (the quality to fall back to). Returns false if the option is unknown
+  // or the value invalid.
+  bool
+  set(const char* name, const char* value);
+
+  // Parses "<name>=<value>".
+  bool
+  parse(const char* option);
+
+  bool
+  isEnabled() const;
+
+  // Whether to skip all pending frames but the latest.
+  bool
+  isShedding() const;
+
+  // Returns the quality to encode with instead of the given one.
+  unsigned int
+  getQuality(unsigned int quality) const;
+
+  // Call once a frame has been handed off, with the number of frames that
+  // were skipped to get to it.
+  void
+  onFrameSent(Clock::time_point availableAt, Clock::time_point sentAt,
+    int skipped);
+
+private:
+  bool mEnabled;
+  std::chrono::milliseconds mTarget;
+  std::chrono::milliseconds mInterval;
+  unsigned int mQuality;
+  Level mLevel;
+  bool mHasWindow;
+  Clock::time_point mWindowStart;
+  Clock::duration mMinLatency;
+  Clock::duration mMaxLatency;
+  int mSkipped;
+  int mCalmIntervals;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "MotionAdapter.hpp"
+
+#include <string.h>
+
+#include "util/option.hpp"
+
+// Quality for frames in motion unless set otherwise.
+#define DEFAULT_QUALITY 50
+
+// Longer than the gaps between frames of any animation, but short enough
+// that the refinement follows soon after it ends.
+#define DEFAULT_SETTLE_MS 250
+
+MotionAdapter::MotionAdapter()
+  : mEnabled(false),
+    mQuality(DEFAULT_QUALITY),
+    mScale(1),
+    mSettle(DEFAULT_SETTLE_MS),
+    mHasLastFrame(false),
+    mHasRefinement(false) {
+}
+
+bool
+MotionAdapter::set(const char* name, const char* value) {
+  long number;
+  if (!option_parse_number(value, &number)) {
+    return false;
+  }
+
+  if (strcmp(name, "quality") == 0 && number <= 100) {
+    mQuality = number;
+    mEnabled = true;
+    return true;
+  }
+
+  if (strcmp(name, "scale") == 0 && number >= 1 && number <= MAX_SCALE) {
+    mScale = number;
+    mEnabled = true;
+    return true;
+  }
+
+  if (strcmp(name, "settle") == 0 && number > 0) {
+    mSettle = std::chrono::milliseconds(number);
+    mEnabled = true;
+    return true;
+  }
+
+  return false;
+}
+
+bool
+MotionAdapter::parse(const char* option) {
+  return option_parse(option, *this);
+}
+
+bool
+MotionAdapter::isEnabled() const {
+  return mEnabled;
+}
+
+bool
+MotionAdapter::onFrame(Clock::time_point availableAt) {
+  bool moving = mEnabled && mHasLastFrame && availableAt - mLastFrameAt < mSettle;
+
+  mHasLastFrame = true;
+  mLastFrameAt = availableAt;
+
+  // A frame that isn't in motion goes out in full quality, so there's
+  // nothing left to refine.
+  if (!moving) {
+    mHasRefinement = false;
+  }
+
+  return moving;
+}
+
+unsigned int
+MotionAdapter::getQuality() const {
+  return mQuality;
+}
+
+Minicap::Frame*
+MotionAdapter::reduce(Minicap::Frame* frame) {
+  // Averaging needs a byte per channel.
+  if (mScale == 1 || frame->format == Minicap::FORMAT_RGB_565
+      || frame->width < mScale || frame->height < mScale) {
+    return frame;
+  }
+
+  uint32_t width = frame->width / mScale;
+  uint32_t height = frame->height / mScale;
+  size_t rowSize = static_cast<size_t>(width) * frame->bpp;
+
+  mReducedPixels.resize(rowSize * height);
+
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+  unsigned int area = mScale * mScale;
+
+  for (uint32_t y = 0; y < height; ++y) {
+    const unsigned char* in = data + y * mScale * stride;
+    unsigned char* out = mReducedPixels.data() + y * rowSize;
+
+    for (uint32_t x = 0; x < width; ++x) {
+      for (uint32_t c = 0; c < frame->bpp; ++c) {
+        unsigned int sum = 0;
+
+        for (uint32_t dy = 0; dy < mScale; ++dy) {
+          const unsigned char* p = in + dy * stride + c;
+
+          for (uint32_t dx = 0; dx < mScale; ++dx) {
+            sum += p[dx * frame->bpp];
+          }
+        }
+
+        *out++ = sum / area;
+      }
+
+      in += mScale * frame->bpp;
+    }
+  }
+
+  mReduced = *frame;
+  mReduced.data = mReducedPixels.data();
+  mReduced.width = width;
+  mReduced.height = height;
+  mReduced.stride = width;
+  mReduced.size = mReducedPixels.size();
+
+  return &mReduced;
+}
+
+void
+MotionAdapter::keep(Minicap::Frame* frame, Clock::time_point availableAt) {
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+  size_t rowSize = static_cast<size_t>(frame->width) * frame->bpp;
+
+  mRefinementPixels.resize(rowSize * frame->height);
+
+  for (uint32_t y = 0; y < frame->height; ++y) {
+    memcpy(mRefinementPixels.data() + y * rowSize, data + y * stride, rowSize);
+  }
+
+  mRefinement = *frame;
+  mRefinement.data = mRefinementPixels.data();
+  mRefinement.stride = frame->width;
+  mRefinement.size = mRefinementPixels.size();
+  mRefinementAt = availableAt;
+  mHasRefinement = true;
+}
+
+bool
+MotionAdapter::hasRefinement() const {
+  return mHasRefinement;
+}
+
+void
+MotionAdapter::cancelRefinement() {
+  mHasRefinement = false;
+}
+
+MotionAdapter::Clock::time_point
+MotionAdapter::getRefinementDeadline() const {
+  return mLastFrameAt + mSettle;
+}
+
+Minicap::Frame*
+MotionAdapter::takeRefinement(Clock::time_point* availableAt) {
+  mHasRefinement = false;
+  *availableAt = mRefinementAt;
+  return &mRefinement;
+}
@@ -0,0 +1,90 @@
+#ifndef MINICAP_MOTION_ADAPTER_HPP
+#define MINICAP_MOTION_ADAPTER_HPP
+
+#include <chrono>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Minicap.hpp"
+
+// Trades quality for speed while the screen is in motion, i.e. while
+// frames keep arriving back to back, as nobody can see the difference
+// during an animation anyway. Frames in motion are encoded with a lower
+// quality, and optionally downscaled. Once the screen has settled, the
+// last frame is sent again in full quality. Does nothing unless
+// configured.
+class MotionAdapter {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  static const unsigned int MAX_SCALE = 4;
+
+  MotionAdapter();
+
+  // Sets an option by name. Known options are "quality" (for frames in
+  // motion), "scale" (1 to MAX_SCALE, divides the size of frames in
+  // motion) and "settle" (the number of milliseconds without new frames
+  // after which the screen is considered static). Returns false if the
+  // option is unknown or the value invalid.
+  bool
+  set(const char* name, const char* value);
+
+  // Parses "<name>=<value>".
+  bool
+  parse(const char* option);
+
+  bool
+  isEnabled() const;
+
+  // Call for every new frame. Returns true if the screen is in motion, in
+  // which case the frame should be passed through reduce() and encoded
+  // with getQuality(), and then kept with keep().
+  bool
+  onFrame(Clock::time_point availableAt);
+
+  unsigned int
+  getQuality() const;
+
+  // Returns the frame to encode, which is either the given frame or a
+  // downscaled copy of it.
+  Minicap::Frame*
+  reduce(Minicap::Frame* frame);
+
+  // Keeps a copy of the frame for refinement.
+  void
+  keep(Minicap::Frame* frame, Clock::time_point availableAt);
+
+  bool
+  hasRefinement() const;
+
+  // Forgets the kept frame, e.g. when a newer one went out in full
+  // quality anyway.
+  void
+  cancelRefinement();
+
+  // When to send the refinement if no new frames come in before that.
+  Clock::time_point
+  getRefinementDeadline() const;
+
+  // Returns the kept frame and when it originally became available. Valid
+  // until the next call to keep().
+  Minicap::Frame*
+  takeRefinement(Clock::time_point* availableAt);
+
+private:
+  bool mEnabled;
+  unsigned int mQuality;
+  unsigned int mScale;
+  std::chrono::milliseconds mSettle;
+  bool mHasLastFrame;
+  Clock::time_point mLastFrameAt;
+  bool mHasRefinement;
+  Clock::time_point mRefinementAt;
+  Minicap::Frame mRefinement;
+  std::vector<unsigned char> mRefinementPixels;
+  Minicap::Frame mReduced;
+  std::vector<unsigned char> mReducedPixels;
+};
+
+#endif
@@ -0,0 +1,609 @@
+#include "MuxClient.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util/debug.h"
+#include "util/pump.hpp"
+
+static void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+std::chrono::steady_clock::time_point
+MuxClient::Subscription::getDemandAt() {
+  std::unique_lock<std::mutex> lock(client->mMutex);
+
+  if (!client->mReady || client->mClosed || !subscribed
+      || (pendingFrame && !awaitingKeyFrame)) {
+    return Clock::time_point::max();
+  }
+
+  return nextFrameAt;
+}
+
+void
+MuxClient::Subscription::push(std::shared_ptr<EncodedFrame> frame) {
+  {
+    std::unique_lock<std::mutex> lock(client->mMutex);
+
+    // A frame may still come in right after unsubscribing.
+    if (!subscribed) {
+      return;
+    }
+
+    pendingFrame = frame;
+  }
+
+  client->wake();
+}
+
+bool
+MuxClient::Subscription::hasReceived(EncodedFrame* frame) {
+  if (hasLastFrame && frame->getSequence() == lastFrameSequence) {
+    return true;
+  }
+
+  return !frame->getReference() && hasKeyFrame
+    && frame->getSequence() == keyFrameSequence;
+}
+
+bool
+MuxClient::Subscription::isReplayTooLong(EncodedFrame* frame) {
+  unsigned int missing = 0;
+  size_t missingBytes = 0;
+
+  for (std::shared_ptr<EncodedFrame> reference = frame->getReference();
+      reference && !hasReceived(reference.get());
+      reference = reference->getReference()) {
+    if (!reference->getReference()) {
+      continue;
+    }
+
+    missing += 1;
+    missingBytes += reference->getSize();
+
+    if (missing > Client::MAX_REPLAY_FRAMES || missingBytes > Client::MAX_REPLAY_BYTES) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+MuxClient::MuxClient(int fd, uint32_t streamCount, Listener* listener)
+  : mFd(fd),
+    mEventFd(eventfd(0, EFD_NONBLOCK)),
+    mListener(listener),
+    mInputLength(0),
+    mReady(false),
+    mStopping(false),
+    mClosed(false) {
+  for (uint32_t stream = 0; stream < streamCount; ++stream) {
+    std::unique_ptr<Subscription> subscription(new Subscription());
+    subscription->client = this;
+    subscription->stream = stream;
+    subscription->subscribed = false;
+    subscription->hasPendingBanner = false;
+    subscription->hasKeyFrame = false;
+    subscription->keyFrameSequence = 0;
+    subscription->hasLastFrame = false;
+    subscription->lastFrameSequence = 0;
+    subscription->awaitingKeyFrame = false;
+    subscription->minFrameInterval = Clock::duration::zero();
+    subscription->nextFrameAt = Clock::now();
+    mSubscriptions.push_back(std::move(subscription));
+  }
+}
+
+MuxClient::~MuxClient() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+
+  // Wake up the thread whether it's polling or stuck in sendmsg().
+  wake();
+  ::shutdown(mFd, SHUT_RDWR);
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+
+  ::close(mFd);
+
+  if (mEventFd >= 0) {
+    ::close(mEventFd);
+  }
+}
+
+void
+MuxClient::setSocketOptions(const SocketOptions& options) {
+  mSocketOptions = options;
+}
+
+void
+MuxClient::start() {
+  mThread = std::thread(&MuxClient::run, this);
+}
+
+ClientManager::Subscriber*
+MuxClient::getSubscriber(uint32_t stream) {
+  return mSubscriptions[stream].get();
+}
+
+bool
+MuxClient::isClosed() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  return mClosed;
+}
+
+void
+MuxClient::run() {
+  unsigned char banner[BANNER_SIZE];
+  banner[0] = BANNER_VERSION;
+  banner[1] = BANNER_SIZE;
+  banner[2] = mSubscriptions.size();
+
+  if (pumps(mFd, banner, BANNER_SIZE) < 0) {
+    goto close;
+  }
+
+  mSender.enable(mFd);
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mReady = true;
+  }
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+
+      if (mStopping) {
+        break;
+      }
+    }
+
+    int timeout = -1;
+    if (!sendPending(&timeout)) {
+      break;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = mFd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = mEventFd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      MCERROR("Unable to poll multiplexed client");
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      read(mEventFd, &value, sizeof(value));
+    }
+
+    // Same as for regular clients.
+    if ((fds[0].revents & POLLERR) && mSender.reap(mFd)) {
+      fds[0].revents &= ~POLLERR;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (!processInput()) {
+        break;
+      }
+    }
+  }
+
+close:
+  MCINFO("Closing multiplexed client connection");
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mClosed = true;
+  }
+
+  for (auto& subscription: mSubscriptions) {
+    unsubscribe(subscription.get());
+  }
+}
+
+void
+MuxClient::wake() {
+  uint64_t value = 1;
+  write(mEventFd, &value, sizeof(value));
+}
+
+bool
+MuxClient::sendPending(int* timeout) {
+  struct Message {
+    uint32_t stream;
+    std::vector<unsigned char> banner;
+    bool isBanner;
+    std::shared_ptr<EncodedFrame> frame;
+  };
+
+  std::vector<Message> messages;
+  std::vector<uint32_t> keyFrameStreams;
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    Clock::time_point now = Clock::now();
+
+    for (auto& subscription: mSubscriptions) {
+      if (subscription->hasPendingBanner) {
+        Message message;
+        message.stream = subscription->stream;
+        message.banner.swap(subscription->banner);
+        message.isBanner = true;
+        messages.push_back(std::move(message));
+        subscription->hasPendingBanner = false;
+      }
+
+      if (!subscription->pendingFrame) {
+        continue;
+      }
+
+      // Same as for regular clients.
+      if (now >= subscription->nextFrameAt) {
+        if (!subscription->isReplayTooLong(subscription->pendingFrame.get())) {
+          subscription->awaitingKeyFrame = false;
+        }
+        else if (!subscription->awaitingKeyFrame) {
+          subscription->awaitingKeyFrame = true;
+          subscription->keyFrameDeadline = now
+            + std::chrono::milliseconds(Client::MAX_KEY_FRAME_WAIT_MS);
+          keyFrameStreams.push_back(subscription->stream);
+        }
+      }
+
+      if (subscription->awaitingKeyFrame && now < subscription->keyFrameDeadline) {
+        int wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          subscription->keyFrameDeadline - now).count() + 1;
+        if (*timeout < 0 || wait < *timeout) {
+          *timeout = wait;
+        }
+      }
+      else if (now >= subscription->nextFrameAt) {
+        subscription->awaitingKeyFrame = false;
+
+        Message message;
+        message.stream = subscription->stream;
+        message.isBanner = false;
+        message.frame = std::move(subscription->pendingFrame);
+        messages.push_back(std::move(message));
+
+        subscription->nextFrameAt += subscription->minFrameInterval;
+        if (subscription->nextFrameAt <= now) {
+          subscription->nextFrameAt = now + subscription->minFrameInterval;
+        }
+      }
+      else {
+        int wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          subscription->nextFrameAt - now).count() + 1;
+        if (*timeout < 0 || wait < *timeout) {
+          *timeout = wait;
+        }
+      }
+    }
+  }
+
+  for (uint32_t stream: keyFrameStreams) {
+    mListener->onKeyFrameRequested(this, stream);
+  }
+
+  if (messages.empty()) {
+    return true;
+  }
+
+  // Frames may depend on ones the client is missing, which then go out
+  // first.
+  std::vector<std::shared_ptr<EncodedFrame>> frames;
+  std::vector<uint32_t> streams;
+  size_t headersSize = 0;
+
+  for (auto& message: messages) {
+    if (message.isBanner) {
+      headersSize += MESSAGE_HEADER_SIZE + message.banner.size();
+      continue;
+    }
+
+    Subscription* subscription = mSubscriptions[message.stream].get();
+    size_t first = frames.size();
+
+    frames.push_back(message.frame);
+    for (std::shared_ptr<EncodedFrame> reference = message.frame->getReference();
+        reference && !subscription->hasReceived(reference.get());
+        reference = reference->getReference()) {
+      frames.push_back(reference);
+    }
+
+    std::reverse(frames.begin() + first, frames.end());
+    streams.resize(frames.size(), message.stream);
+
+    for (size_t i = first; i < frames.size(); ++i) {
+      if (!frames[i]->getReference()) {
+        subscription->hasKeyFrame = true;
+        subscription->keyFrameSequence = frames[i]->getSequence();
+      }
+    }
+
+    subscription->hasLastFrame = true;
+    subscription->lastFrameSequence = message.frame->getSequence();
+  }
+
+  headersSize += MESSAGE_HEADER_SIZE * frames.size();
+
+  // Banners are small enough to go out with the message headers. Frames
+  // are sent straight from where they are.
+  std::vector<unsigned char> headers(headersSize);
+  std::vector<struct iovec> iov;
+  unsigned char* header = headers.data();
+
+  for (auto& message: messages) {
+    if (!message.isBanner) {
+      continue;
+    }
+
+    header[0] = message.stream;
+    putUInt32LE(header + 1, message.banner.size());
+    memcpy(header + MESSAGE_HEADER_SIZE, message.banner.data(), message.banner.size());
+
+    struct iovec vec;
+    vec.iov_base = header;
+    vec.iov_len = MESSAGE_HEADER_SIZE + message.banner.size();
+    iov.push_back(vec);
+
+    header += vec.iov_len;
+  }
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    header[0] = streams[i];
+    putUInt32LE(header + 1, frames[i]->getSize());
+
+    struct iovec vec;
+    vec.iov_base = header;
+    vec.iov_len = MESSAGE_HEADER_SIZE;
+    iov.push_back(vec);
+
+    vec.iov_base = frames[i]->getData();
+    vec.iov_len = frames[i]->getSize();
+    iov.push_back(vec);
+
+    header += MESSAGE_HEADER_SIZE;
+  }
+
+  if (mSender.send(mFd, iov.data(), iov.size(), frames, headers) < 0) {
+    return false;
+  }
+
+  for (auto& message: messages) {
+    if (!message.isBanner) {
+      mListener->onStreamStateChanged(this, message.stream);
+    }
+  }
+
+  return true;
+}
+
+bool
+MuxClient::processInput() {
+  int got = recv(mFd, mInput + mInputLength,
+    MAX_INPUT_LENGTH - mInputLength, MSG_DONTWAIT);
+
+  if (got == 0) {
+    return false;
+  }
+
+  if (got < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+
+  mInputLength += got;
+
+  char* start = mInput;
+  char* end = mInput + mInputLength;
+  char* newline;
+
+  while ((newline = static_cast<char*>(memchr(start, '\n', end - start))) != NULL) {
+    *newline = '\0';
+    handleCommand(start);
+    start = newline + 1;
+  }
+
+  mInputLength = end - start;
+
+  if (mInputLength >= MAX_COMMAND_LENGTH) {
+    MCERROR("Multiplexed client command too long");
+    return false;
+  }
+
+  memmove(mInput, start, mInputLength);
+
+  return true;
+}
+
+void
+MuxClient::handleCommand(char* line) {
+  char* saveptr;
+  char* command = strtok_r(line, " \t\r\n", &saveptr);
+
+  if (command == NULL) {
+    return;
+  }
+
+  if (strcmp(command, "subscribe") == 0) {
+    Subscription* subscription = getSubscription(&saveptr);
+    if (subscription != NULL) {
+      subscribe(subscription);
+    }
+    return;
+  }
+
+  if (strcmp(command, "unsubscribe") == 0) {
+    Subscription* subscription = getSubscription(&saveptr);
+    if (subscription != NULL) {
+      unsubscribe(subscription);
+    }
+    return;
+  }
+
+  if (strcmp(command, "rate") == 0) {
+    Subscription* subscription = getSubscription(&saveptr);
+    if (subscription == NULL) {
+      return;
+    }
+
+    char* arg = strtok_r(NULL, " \t\r", &saveptr);
+    if (arg == NULL || atof(arg) < 0) {
+      MCINFO("Invalid client frame rate, expecting a float >= 0");
+      return;
+    }
+
+    float frameRate = atof(arg);
+
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+
+      if (frameRate > 0) {
+        subscription->minFrameInterval = std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(1.0 / frameRate));
+      }
+      else {
+        subscription->minFrameInterval = Clock::duration::zero();
+      }
+
+      subscription->nextFrameAt = Clock::now();
+    }
+
+    mListener->onStreamStateChanged(this, subscription->stream);
+    return;
+  }
+
+  if (strcmp(command, "sockopt") == 0) {
+    char* arg = strtok_r(NULL, " \t\r", &saveptr);
+    if (arg == NULL || !mSocketOptions.parse(arg)) {
+      MCINFO("Invalid socket option, expecting <name>=<value>");
+      return;
+    }
+
+    mSocketOptions.apply(mFd);
+    return;
+  }
+
+  if (strcmp(command, "boost") == 0) {
+    Subscription* subscription = getSubscription(&saveptr);
+    if (subscription == NULL) {
+      return;
+    }
+
+    char* arg = strtok_r(NULL, " \t\r", &saveptr);
+    char* end;
+    long duration = arg != NULL ? strtol(arg, &end, 10) : -1;
+
+    if (arg == NULL || *end != '\0' || duration < 0 || duration > MAX_BOOST_DURATION) {
+      MCINFO("Invalid boost duration, expecting 0-%u ms", MAX_BOOST_DURATION);
+      return;
+    }
+
+    // The rest of the line is the list of regions, which may well be
+    // empty.
+    char* value = saveptr != NULL ? saveptr + strspn(saveptr, " \t") : NULL;
+    char* valueEnd = value != NULL ? value + strlen(value) : NULL;
+
+    while (valueEnd != NULL && valueEnd > value && strchr(" \t\r", valueEnd[-1]) != NULL) {
+      *--valueEnd = '\0';
+    }
+
+    mListener->onBoostRequested(this, subscription->stream, duration,
+      value != NULL ? value : "");
+    return;
+  }
+
+  MCINFO("Ignoring unknown multiplexed client command '%s'", command);
+}
+
+MuxClient::Subscription*
+MuxClient::getSubscription(char** saveptr) {
+  char* arg = strtok_r(NULL, " \t\r", saveptr);
+  char* end;
+  long stream = arg != NULL ? strtol(arg, &end, 10) : -1;
+
+  if (arg == NULL || *end != '\0' || stream < 0
+      || static_cast<size_t>(stream) >= mSubscriptions.size()) {
+    MCINFO("Invalid stream, expecting 0-%u", static_cast<unsigned int>(mSubscriptions.size() - 1));
+    return NULL;
+  }
+
+  return mSubscriptions[stream].get();
+}
+
+void
+MuxClient::subscribe(Subscription* subscription) {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (subscription->subscribed) {
+      return;
+    }
+
+    // Whatever the client had of the stream is gone by now.
+    subscription->subscribed = true;
+    subscription->hasKeyFrame = false;
+    subscription->hasLastFrame = false;
+    subscription->awaitingKeyFrame = false;
+    subscription->nextFrameAt = Clock::now();
+  }
+
+  std::vector<unsigned char> banner;
+  bool exists = mListener->onSubscribeRequested(this, subscription->stream,
+    subscription, &banner);
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (!exists) {
+    // The empty banner tells the client.
+    subscription->subscribed = false;
+    banner.clear();
+  }
+
+  subscription->banner.swap(banner);
+  subscription->hasPendingBanner = true;
+}
+
+void
+MuxClient::unsubscribe(Subscription* subscription) {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (!subscription->subscribed) {
+      return;
+    }
+
+    subscription->subscribed = false;
+    subscription->pendingFrame.reset();
+  }
+
+  mListener->onUnsubscribeRequested(this, subscription->stream, subscription);
+}
@@ -0,0 +1,164 @@
+#ifndef MINICAP_MUX_CLIENT_HPP
+#define MINICAP_MUX_CLIENT_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ClientManager.hpp"
+#include "EncodedFrame.hpp"
+#include "SocketOptions.hpp"
+#include "ZeroCopySender.hpp"
+
+// A single connection that carries any number of streams, each of which
+// the client subscribes to and unsubscribes from as it pleases. Every
+// message is tagged with the ID of the stream it belongs to, and
+// whatever is due for all streams goes out with a single write. See the
+// README for the protocol.
+class MuxClient {
+public:
+  static const unsigned char BANNER_VERSION = 1;
+  static const size_t BANNER_SIZE = 3;
+  static const size_t MESSAGE_HEADER_SIZE = 5;
+  static const uint32_t MAX_STREAMS = 255;
+
+  struct Listener {
+    virtual
+    ~Listener() {}
+
+    // Called from the client's thread. Adds the subscriber to the stream,
+    // and copies the banner of the stream. Returns false if there is no
+    // such stream.
+    virtual bool
+    onSubscribeRequested(MuxClient* client, uint32_t stream,
+      ClientManager::Subscriber* subscriber, std::vector<unsigned char>* banner) = 0;
+
+    // Called from the client's thread, also when the client closes.
+    virtual void
+    onUnsubscribeRequested(MuxClient* client, uint32_t stream,
+      ClientManager::Subscriber* subscriber) = 0;
+
+    // Called from the client's thread when it becomes able to take a new
+    // frame of the stream.
+    virtual void
+    onStreamStateChanged(MuxClient* client, uint32_t stream) = 0;
+
+    // Same as Client::Listener::onBoostRequested(), but for a single
+    // stream.
+    virtual void
+    onBoostRequested(MuxClient* client, uint32_t stream, unsigned int duration,
+      const char* regions) = 0;
+
+    // Same as Client::Listener::onKeyFrameRequested(), but for a single
+    // stream.
+    virtual void
+    onKeyFrameRequested(MuxClient* client, uint32_t stream) = 0;
+  };
+
+  MuxClient(int fd, uint32_t streamCount, Listener* listener);
+
+  ~MuxClient();
+
+  void
+  setSocketOptions(const SocketOptions& options);
+
+  // Starts serving the client on its own thread.
+  void
+  start();
+
+  // The subscriber through which the stream hands frames to us. Always
+  // the same object, whether or not we're currently subscribed.
+  ClientManager::Subscriber*
+  getSubscriber(uint32_t stream);
+
+  bool
+  isClosed();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  static const size_t MAX_INPUT_LENGTH = 4096;
+  static const size_t MAX_COMMAND_LENGTH = 256;
+  static const unsigned int MAX_BOOST_DURATION = 10000;
+
+  // The state of a single stream. Guarded by the client's mutex.
+  struct Subscription: public ClientManager::Subscriber {
+    MuxClient* client;
+    uint32_t stream;
+    bool subscribed;
+    // A banner that has yet to be sent. Empty if the subscription failed.
+    bool hasPendingBanner;
+    std::vector<unsigned char> banner;
+    std::shared_ptr<EncodedFrame> pendingFrame;
+    bool hasKeyFrame;
+    uint32_t keyFrameSequence;
+    bool hasLastFrame;
+    uint32_t lastFrameSequence;
+    bool awaitingKeyFrame;
+    Clock::time_point keyFrameDeadline;
+    Clock::duration minFrameInterval;
+    Clock::time_point nextFrameAt;
+
+    Clock::time_point
+    getDemandAt();
+
+    void
+    push(std::shared_ptr<EncodedFrame> frame);
+
+    // Whether the client already has the frame, for frames that other
+    // frames depend on.
+    bool
+    hasReceived(EncodedFrame* frame);
+
+    // Same as Client::isReplayTooLong().
+    bool
+    isReplayTooLong(EncodedFrame* frame);
+  };
+
+  int mFd;
+  int mEventFd;
+  Listener* mListener;
+  SocketOptions mSocketOptions;
+  ZeroCopySender mSender;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::vector<std::unique_ptr<Subscription>> mSubscriptions;
+  char mInput[MAX_INPUT_LENGTH + 1];
+  size_t mInputLength;
+  bool mReady;
+  bool mStopping;
+  bool mClosed;
+
+  void
+  run();
+
+  void
+  wake();
+
+  // Sends everything that's due in one go. Sets timeout to how long to
+  // wait for the next frame that isn't due yet, if any.
+  bool
+  sendPending(int* timeout);
+
+  bool
+  processInput();
+
+  void
+  handleCommand(char* line);
+
+  // Parses the stream ID argument of a command.
+  Subscription*
+  getSubscription(char** saveptr);
+
+  void
+  subscribe(Subscription* subscription);
+
+  void
+  unsubscribe(Subscription* subscription);
+};
+
+#endif
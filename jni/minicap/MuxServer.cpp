@@ -0,0 +1,175 @@
+#include "MuxServer.hpp"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "util/debug.h"
+
+MuxServer::MuxServer(uint32_t streamCount)
+  : mStreams(streamCount, NULL),
+    mServer(NULL),
+    mStopped(false) {
+}
+
+MuxServer::~MuxServer() {
+  stop();
+}
+
+void
+MuxServer::setStream(uint32_t stream, ClientManager* clients) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  ClientManager* previous = mStreams[stream];
+  mStreams[stream] = clients;
+
+  // Whoever was subscribed is gone along with the stream.
+  if (previous != NULL) {
+    for (auto& client: mClients) {
+      previous->removeSubscriber(client->getSubscriber(stream));
+    }
+  }
+}
+
+void
+MuxServer::listen(SimpleServer* server) {
+  mServer = server;
+  mAcceptThread = std::thread(&MuxServer::acceptClients, this);
+}
+
+void
+MuxServer::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+  }
+
+  // Unblocks accept().
+  if (mServer != NULL) {
+    mServer->shutdown();
+  }
+
+  if (mAcceptThread.joinable()) {
+    mAcceptThread.join();
+  }
+
+  mServer = NULL;
+
+  std::vector<std::shared_ptr<MuxClient>> clients;
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    clients.swap(mClients);
+  }
+
+  // Clients unsubscribe from everything as they close, so the streams
+  // never see them again.
+  clients.clear();
+}
+
+bool
+MuxServer::onSubscribeRequested(MuxClient* client, uint32_t stream,
+    ClientManager::Subscriber* subscriber, std::vector<unsigned char>* banner) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  ClientManager* clients = mStreams[stream];
+  if (clients == NULL) {
+    MCINFO("Stream %u is not available", stream);
+    return false;
+  }
+
+  *banner = clients->getBanner();
+  clients->addSubscriber(subscriber);
+
+  return true;
+}
+
+void
+MuxServer::onUnsubscribeRequested(MuxClient* client, uint32_t stream,
+    ClientManager::Subscriber* subscriber) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (mStreams[stream] != NULL) {
+    mStreams[stream]->removeSubscriber(subscriber);
+  }
+}
+
+void
+MuxServer::onStreamStateChanged(MuxClient* client, uint32_t stream) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (mStreams[stream] != NULL) {
+    mStreams[stream]->notifySubscriberStateChanged();
+  }
+}
+
+void
+MuxServer::onBoostRequested(MuxClient* client, uint32_t stream, unsigned int duration,
+    const char* regions) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (mStreams[stream] != NULL) {
+    mStreams[stream]->onBoostRequested(NULL, duration, regions);
+  }
+}
+
+void
+MuxServer::onKeyFrameRequested(MuxClient* client, uint32_t stream) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (mStreams[stream] != NULL) {
+    mStreams[stream]->onKeyFrameRequested(NULL);
+  }
+}
+
+void
+MuxServer::acceptClients() {
+  while (true) {
+    int fd = mServer->accept();
+
+    std::vector<std::shared_ptr<MuxClient>> closed;
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (fd < 0) {
+      if (mStopped) {
+        break;
+      }
+
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      MCERROR("Unable to accept multiplexed client connection");
+      break;
+    }
+
+    if (mStopped) {
+      ::close(fd);
+      break;
+    }
+
+    MCINFO("New multiplexed client connection");
+
+    // Nobody else checks for closed clients, but they pile up slowly
+    // enough that doing it here is fine.
+    takeClosedClients(closed);
+
+    std::shared_ptr<MuxClient> client = std::make_shared<MuxClient>(fd,
+      mStreams.size(), this);
+    client->setSocketOptions(mServer->getSocketOptions());
+    client->start();
+    mClients.push_back(client);
+  }
+}
+
+void
+MuxServer::takeClosedClients(std::vector<std::shared_ptr<MuxClient>>& closed) {
+  for (auto it = mClients.begin(); it != mClients.end();) {
+    if ((*it)->isClosed()) {
+      closed.push_back(*it);
+      it = mClients.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
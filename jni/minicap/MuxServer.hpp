@@ -0,0 +1,74 @@
+#ifndef MINICAP_MUX_SERVER_HPP
+#define MINICAP_MUX_SERVER_HPP
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ClientManager.hpp"
+#include "MuxClient.hpp"
+#include "SimpleServer.hpp"
+
+// Accepts multiplexed clients, and connects them to the streams they
+// subscribe to. Each stream is served by a ClientManager of its own, to
+// which subscribed clients look just like regular ones.
+class MuxServer: public MuxClient::Listener {
+public:
+  MuxServer(uint32_t streamCount);
+
+  ~MuxServer();
+
+  // Makes the stream available to clients, or unavailable if clients is
+  // NULL. Streams must be made unavailable before their ClientManager
+  // goes away.
+  void
+  setStream(uint32_t stream, ClientManager* clients);
+
+  // Starts accepting clients from the server on a separate thread.
+  void
+  listen(SimpleServer* server);
+
+  // Stops accepting clients and disconnects all existing ones.
+  void
+  stop();
+
+  bool
+  onSubscribeRequested(MuxClient* client, uint32_t stream,
+    ClientManager::Subscriber* subscriber, std::vector<unsigned char>* banner);
+
+  void
+  onUnsubscribeRequested(MuxClient* client, uint32_t stream,
+    ClientManager::Subscriber* subscriber);
+
+  void
+  onStreamStateChanged(MuxClient* client, uint32_t stream);
+
+  void
+  onBoostRequested(MuxClient* client, uint32_t stream, unsigned int duration,
+    const char* regions);
+
+  void
+  onKeyFrameRequested(MuxClient* client, uint32_t stream);
+
+private:
+  // Guards the streams, and the clients that are subscribed to them.
+  std::mutex mMutex;
+  std::vector<ClientManager*> mStreams;
+  std::vector<std::shared_ptr<MuxClient>> mClients;
+  SimpleServer* mServer;
+  std::thread mAcceptThread;
+  bool mStopped;
+
+  void
+  acceptClients();
+
+  // Moves closed clients to the given list. They must be destroyed only
+  // after releasing the lock, as destroying a client joins its thread.
+  void
+  takeClosedClients(std::vector<std::shared_ptr<MuxClient>>& closed);
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include "PngEncoder.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "util/debug.h"
+
+#define PNG_SIGNATURE_SIZE 8
+#define PNG_CHUNK_OVERHEAD 12
+#define PNG_IHDR_SIZE 13
+#define PNG_IDAT_OFFSET (PNG_SIGNATURE_SIZE + PNG_CHUNK_OVERHEAD + PNG_IHDR_SIZE)
+
+// More threads than this don't pay off, as deflate ends up dominating.
+#define MAX_FILTER_THREADS 4
+
+enum {
+  PNG_FILTER_SUB   = 1,
+  PNG_FILTER_UP    = 2,
+  PNG_FILTER_PAETH = 4,
+};
+
+static unsigned char*
+putUInt32BE(unsigned char* data, uint32_t value) {
+  data[0] = (value >> 24) & 0xFF;
+  data[1] = (value >> 16) & 0xFF;
+  data[2] = (value >> 8) & 0xFF;
+  data[3] = value & 0xFF;
+  return data + 4;
+}
+
+// Fills in the length and CRC of a chunk whose type and data are already
+// in place after the length field.
+static unsigned char*
+finishChunk(unsigned char* chunk, uint32_t length) {
+  putUInt32BE(chunk, length);
+  uint32_t crc = crc32(0, chunk + 4, 4 + length);
+  return putUInt32BE(chunk + 8 + length, crc);
+}
+
+static inline unsigned char
+paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+
+  return pb <= pc ? b : c;
+}
+
+// Converts a row to RGB(A) in PNG order.
+static void
+convertRow(const unsigned char* src, uint32_t width, uint32_t bpp,
+    const FrameEncoder::Layout& layout, int channels, unsigned char* out) {
+  for (uint32_t x = 0; x < width; ++x, src += bpp, out += channels) {
+    out[0] = src[layout.r];
+    out[1] = src[layout.g];
+    out[2] = src[layout.b];
+
+    if (channels == 4) {
+      out[3] = src[layout.a];
+    }
+  }
+}
+
+// Picks the filter with the smallest sum of absolute differences, which
+// is the usual heuristic, and writes the filtered row.
+static void
+filterRow(const unsigned char* cur, const unsigned char* prev, size_t length,
+    int channels, unsigned char* out) {
+  unsigned long sums[3] = { 0, 0, 0 };
+
+  for (size_t i = 0; i < length; ++i) {
+    int left = i >= static_cast<size_t>(channels) ? cur[i - channels] : 0;
+    int up = prev[i];
+    int upLeft = i >= static_cast<size_t>(channels) ? prev[i - channels] : 0;
+
+    sums[0] += abs(static_cast<signed char>(cur[i] - left));
+    sums[1] += abs(static_cast<signed char>(cur[i] - up));
+    sums[2] += abs(static_cast<signed char>(cur[i] - paeth(left, up, upLeft)));
+  }
+
+  int filter = PNG_FILTER_SUB;
+  if (sums[1] < sums[0] && sums[1] <= sums[2]) {
+    filter = PNG_FILTER_UP;
+  }
+  else if (sums[2] < sums[0] && sums[2] < sums[1]) {
+    filter = PNG_FILTER_PAETH;
+  }
+
+  *out++ = filter;
+
+  for (size_t i = 0; i < length; ++i) {
+    int left = i >= static_cast<size_t>(channels) ? cur[i - channels] : 0;
+    int up = prev[i];
+
+    switch (filter) {
+    case PNG_FILTER_SUB:
+      out[i] = cur[i] - left;
+      break;
+    case PNG_FILTER_UP:
+      out[i] = cur[i] - up;
+      break;
+    case PNG_FILTER_PAETH:
+      out[i] = cur[i] - paeth(left, up,
+        i >= static_cast<size_t>(channels) ? prev[i - channels] : 0);
+      break;
+    }
+  }
+}
+
+PngEncoder::PngEncoder()
+  : mStreamReady(false),
+    mThreadCount(std::thread::hardware_concurrency()),
+    mEncodedSize(0) {
+  memset(&mStream, 0, sizeof(mStream));
+
+  if (mThreadCount < 1) {
+    mThreadCount = 1;
+  }
+
+  if (mThreadCount > MAX_FILTER_THREADS) {
+    mThreadCount = MAX_FILTER_THREADS;
+  }
+
+  mStreamReady = deflateInit2(&mStream, Z_BEST_SPEED, Z_DEFLATED, 15, 8,
+    Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+PngEncoder::~PngEncoder() {
+  if (mStreamReady) {
+    deflateEnd(&mStream);
+  }
+}
+
+FrameEncoder::Codec
+PngEncoder::getCodec() {
+  return CODEC_PNG;
+}
+
+bool
+PngEncoder::reserveData(uint32_t width, uint32_t height) {
+  if (!mStreamReady) {
+    MCERROR("Unable to initialize deflate");
+    return false;
+  }
+
+  size_t filteredSize = (1 + static_cast<size_t>(width) * 4) * height;
+  size_t maxSize = getMaxEncodedSize(width, height);
+
+  if (maxSize <= mEncodedData.size()) {
+    return true;
+  }
+
+  MCINFO("Allocating %zu bytes for PNG encoder", maxSize + filteredSize);
+
+  mFiltered.resize(filteredSize);
+  mEncodedData.resize(maxSize);
+
+  return true;
+}
+
+size_t
+PngEncoder::getMaxEncodedSize(uint32_t width, uint32_t height) {
+  // Each row starts with a filter type byte, and incompressible rows
+  // still grow a little with deflate.
+  size_t filteredSize = (1 + static_cast<size_t>(width) * 4) * height;
+  return PNG_IDAT_OFFSET + 2 * PNG_CHUNK_OVERHEAD
+    + deflateBound(&mStream, filteredSize);
+}
+
+bool
+PngEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
+  Layout layout;
+  if (!getLayout(frame->format, &layout)) {
+    MCERROR("Unsupported pixel format for PNG");
+    return false;
+  }
+
+  if (!reserveData(frame->width, frame->height)) {
+    return false;
+  }
+
+  int channels = layout.a >= 0 ? 4 : 3;
+  size_t filteredRowSize = 1 + frame->width * channels;
+  size_t filteredSize = filteredRowSize * frame->height;
+
+  // Filtering is independent for each row, so we can split the frame up.
+  uint32_t rowsPerThread = (frame->height + mThreadCount - 1) / mThreadCount;
+  std::vector<std::thread> threads;
+
+  for (uint32_t first = rowsPerThread; first < frame->height; first += rowsPerThread) {
+    uint32_t last = std::min(first + rowsPerThread, frame->height);
+    threads.push_back(std::thread(&PngEncoder::filterRows, frame, layout,
+      channels, first, last, mFiltered.data() + first * filteredRowSize));
+  }
+
+  filterRows(frame, layout, channels, 0, std::min(rowsPerThread, frame->height),
+    mFiltered.data());
+
+  for (auto& thread: threads) {
+    thread.join();
+  }
+
+  unsigned char* out = mEncodedData.data();
+
+  memcpy(out, "\x89PNG\r\n\x1a\n", PNG_SIGNATURE_SIZE);
+  out += PNG_SIGNATURE_SIZE;
+
+  unsigned char* ihdr = out;
+  memcpy(ihdr + 4, "IHDR", 4);
+  putUInt32BE(ihdr + 8, frame->width);
+  putUInt32BE(ihdr + 12, frame->height);
+  ihdr[16] = 8;
+  ihdr[17] = channels == 4 ? 6 : 2;
+  ihdr[18] = 0;
+  ihdr[19] = 0;
+  ihdr[20] = 0;
+  out = finishChunk(ihdr, PNG_IHDR_SIZE);
+
+  unsigned char* idat = out;
+  memcpy(idat + 4, "IDAT", 4);
+
+  deflateReset(&mStream);
+  mStream.next_in = mFiltered.data();
+  mStream.avail_in = filteredSize;
+  mStream.next_out = idat + 8;
+  mStream.avail_out = mEncodedData.size() - (idat + 8 - mEncodedData.data())
+    - 2 * PNG_CHUNK_OVERHEAD;
+
+  if (deflate(&mStream, Z_FINISH) != Z_STREAM_END) {
+    MCERROR("Unable to deflate PNG data");
+    return false;
+  }
+
+  out = finishChunk(idat, mStream.total_out);
+
+  memcpy(out + 4, "IEND", 4);
+  out = finishChunk(out, 0);
+
+  mEncodedSize = out - mEncodedData.data();
+
+  return true;
+}
+
+int
+PngEncoder::getEncodedSize() {
+  return mEncodedSize;
+}
+
+unsigned char*
+PngEncoder::getEncodedData() {
+  return mEncodedData.data();
+}
+
+void
+PngEncoder::filterRows(Minicap::Frame* frame, Layout layout, int channels,
+    uint32_t first, uint32_t last, unsigned char* out) {
+  size_t rowSize = frame->width * channels;
+  size_t stride = frame->stride * frame->bpp;
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+
+  std::vector<unsigned char> rows(rowSize * 2, 0);
+  unsigned char* cur = rows.data();
+  unsigned char* prev = rows.data() + rowSize;
+
+  if (first > 0) {
+    convertRow(data + (first - 1) * stride, frame->width, frame->bpp, layout,
+      channels, prev);
+  }
+
+  for (uint32_t y = first; y < last; ++y) {
+    convertRow(data + y * stride, frame->width, frame->bpp, layout, channels, cur);
+    filterRow(cur, prev, rowSize, channels, out);
+    out += 1 + rowSize;
+    std::swap(cur, prev);
+  }
+}
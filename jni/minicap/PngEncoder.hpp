@@ -0,0 +1,51 @@
+#ifndef MINICAP_PNG_ENCODER_HPP
+#define MINICAP_PNG_ENCODER_HPP
+
+#include <vector>
+
+#include <zlib.h>
+
+#include "FrameEncoder.hpp"
+#include "Minicap.hpp"
+
+// Encodes frames as PNG images. Rows are filtered in parallel on several
+// threads, and deflate runs at its fastest level, which is plenty for
+// screen content.
+class PngEncoder: public FrameEncoder {
+public:
+  PngEncoder();
+
+  ~PngEncoder();
+
+  Codec
+  getCodec();
+
+  bool
+  reserveData(uint32_t width, uint32_t height);
+
+  size_t
+  getMaxEncodedSize(uint32_t width, uint32_t height);
+
+  bool
+  encode(Minicap::Frame* frame, unsigned int quality);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+private:
+  z_stream mStream;
+  bool mStreamReady;
+  unsigned int mThreadCount;
+  std::vector<unsigned char> mFiltered;
+  std::vector<unsigned char> mEncodedData;
+  size_t mEncodedSize;
+
+  static void
+  filterRows(Minicap::Frame* frame, Layout layout, int channels,
+    uint32_t first, uint32_t last, unsigned char* out);
+};
+
+#endif
@@ -195,8 +195,8 @@ public:
     }
   };
 
-  const uint32_t MAX_WIDTH = 10000;
-  const uint32_t MAX_HEIGHT = 10000;
+  static const uint32_t MAX_WIDTH = 10000;
+  static const uint32_t MAX_HEIGHT = 10000;
 
   uint32_t realWidth;
   uint32_t realHeight;
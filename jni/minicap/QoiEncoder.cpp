@@ -0,0 +1,174 @@
+#include "QoiEncoder.hpp"
+
+#include <string.h>
+
+#include "util/debug.h"
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+enum {
+  QOI_OP_INDEX = 0x00,
+  QOI_OP_DIFF  = 0x40,
+  QOI_OP_LUMA  = 0x80,
+  QOI_OP_RUN   = 0xC0,
+  QOI_OP_RGB   = 0xFE,
+  QOI_OP_RGBA  = 0xFF,
+};
+
+static unsigned char*
+putUInt32BE(unsigned char* data, uint32_t value) {
+  data[0] = (value >> 24) & 0xFF;
+  data[1] = (value >> 16) & 0xFF;
+  data[2] = (value >> 8) & 0xFF;
+  data[3] = value & 0xFF;
+  return data + 4;
+}
+
+QoiEncoder::QoiEncoder()
+  : mEncodedSize(0) {
+}
+
+FrameEncoder::Codec
+QoiEncoder::getCodec() {
+  return CODEC_QOI;
+}
+
+bool
+QoiEncoder::reserveData(uint32_t width, uint32_t height) {
+  size_t maxSize = getMaxEncodedSize(width, height);
+
+  if (maxSize <= mEncodedData.size()) {
+    return true;
+  }
+
+  MCINFO("Allocating %zu bytes for QOI encoder", maxSize);
+
+  mEncodedData.resize(maxSize);
+
+  return true;
+}
+
+size_t
+QoiEncoder::getMaxEncodedSize(uint32_t width, uint32_t height) {
+  // Worst case is a full QOI_OP_RGBA for every pixel.
+  return QOI_HEADER_SIZE + QOI_PADDING_SIZE
+    + static_cast<size_t>(width) * height * 5;
+}
+
+bool
+QoiEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
+  Layout layout;
+  if (!getLayout(frame->format, &layout)) {
+    MCERROR("Unsupported pixel format for QOI");
+    return false;
+  }
+
+  if (!reserveData(frame->width, frame->height)) {
+    return false;
+  }
+
+  unsigned char* out = mEncodedData.data();
+
+  memcpy(out, "qoif", 4);
+  out = putUInt32BE(out + 4, frame->width);
+  out = putUInt32BE(out, frame->height);
+  *out++ = layout.a >= 0 ? 4 : 3;
+  *out++ = 0;
+
+  // Pixels packed as 0xAABBGGRR, so that comparisons are cheap.
+  uint32_t index[64] = { 0 };
+  uint32_t previous = 0xFF000000;
+  unsigned int run = 0;
+
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = frame->stride * frame->bpp;
+
+  for (uint32_t y = 0; y < frame->height; ++y) {
+    const unsigned char* p = data + y * stride;
+    const unsigned char* end = p + frame->width * frame->bpp;
+
+    for (; p < end; p += frame->bpp) {
+      unsigned char r = p[layout.r];
+      unsigned char g = p[layout.g];
+      unsigned char b = p[layout.b];
+      unsigned char a = layout.a >= 0 ? p[layout.a] : 0xFF;
+      uint32_t pixel = r | (g << 8) | (b << 16) | (static_cast<uint32_t>(a) << 24);
+
+      if (pixel == previous) {
+        if (++run == 62) {
+          *out++ = QOI_OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run > 0) {
+        *out++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+
+      int hash = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+
+      if (index[hash] == pixel) {
+        *out++ = QOI_OP_INDEX | hash;
+      }
+      else {
+        index[hash] = pixel;
+
+        if (a == (previous >> 24)) {
+          signed char dr = r - (previous & 0xFF);
+          signed char dg = g - ((previous >> 8) & 0xFF);
+          signed char db = b - ((previous >> 16) & 0xFF);
+          signed char drg = dr - dg;
+          signed char dbg = db - dg;
+
+          if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+            *out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+          }
+          else if (drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8) {
+            *out++ = QOI_OP_LUMA | (dg + 32);
+            *out++ = (drg + 8) << 4 | (dbg + 8);
+          }
+          else {
+            *out++ = QOI_OP_RGB;
+            *out++ = r;
+            *out++ = g;
+            *out++ = b;
+          }
+        }
+        else {
+          *out++ = QOI_OP_RGBA;
+          *out++ = r;
+          *out++ = g;
+          *out++ = b;
+          *out++ = a;
+        }
+      }
+
+      previous = pixel;
+    }
+  }
+
+  if (run > 0) {
+    *out++ = QOI_OP_RUN | (run - 1);
+  }
+
+  static const unsigned char padding[QOI_PADDING_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  memcpy(out, padding, sizeof(padding));
+  out += sizeof(padding);
+
+  mEncodedSize = out - mEncodedData.data();
+
+  return true;
+}
+
+int
+QoiEncoder::getEncodedSize() {
+  return mEncodedSize;
+}
+
+unsigned char*
+QoiEncoder::getEncodedData() {
+  return mEncodedData.data();
+}
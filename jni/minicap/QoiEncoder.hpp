@@ -0,0 +1,38 @@
+#ifndef MINICAP_QOI_ENCODER_HPP
+#define MINICAP_QOI_ENCODER_HPP
+
+#include <vector>
+
+#include "FrameEncoder.hpp"
+#include "Minicap.hpp"
+
+// Encodes frames as QOI images (https://qoiformat.org/), which are
+// lossless and several times faster to produce than PNG.
+class QoiEncoder: public FrameEncoder {
+public:
+  QoiEncoder();
+
+  Codec
+  getCodec();
+
+  bool
+  reserveData(uint32_t width, uint32_t height);
+
+  size_t
+  getMaxEncodedSize(uint32_t width, uint32_t height);
+
+  bool
+  encode(Minicap::Frame* frame, unsigned int quality);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+private:
+  std::vector<unsigned char> mEncodedData;
+  size_t mEncodedSize;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "RawEncoder.hpp"
+
+#include <string.h>
+
+#include "util/debug.h"
+
+static void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+// Written so that the compiler can vectorize it.
+static void
+xorRow(unsigned char* __restrict out, const unsigned char* __restrict a,
+    const unsigned char* __restrict b, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    out[i] = a[i] ^ b[i];
+  }
+}
+
+RawEncoder::RawEncoder(bool compress, bool delta)
+  : mCompress(compress || delta),
+    mDelta(delta),
+    mCompressor(mCompress ? new lz4() : NULL),
+    mEncodedSize(0),
+    mKeyFrame(true),
+    mKeyFrameRequested(true),
+    mKeyFrameSize(0),
+    mKeyWidth(0),
+    mKeyHeight(0),
+    mKeyFormat(Minicap::FORMAT_NONE) {
+}
+
+FrameEncoder::Codec
+RawEncoder::getCodec() {
+  return CODEC_RAW;
+}
+
+bool
+RawEncoder::reserveData(uint32_t width, uint32_t height) {
+  size_t size = static_cast<size_t>(width) * height * 4;
+  size_t maxSize = getMaxEncodedSize(width, height);
+
+  if (maxSize <= mEncodedData.size()) {
+    return true;
+  }
+
+  MCINFO("Allocating %zu bytes for raw encoder", maxSize);
+
+  mEncodedData.resize(maxSize);
+
+  if (mCompress) {
+    mPixels.resize(size);
+  }
+
+  if (mDelta) {
+    mKeyPixels.resize(size);
+  }
+
+  return true;
+}
+
+size_t
+RawEncoder::getMaxEncodedSize(uint32_t width, uint32_t height) {
+  // Incompressible pixels grow a little with LZ4.
+  size_t size = static_cast<size_t>(width) * height * 4;
+  return HEADER_SIZE + (mCompress ? lz4::bound(size) : size);
+}
+
+bool
+RawEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
+  size_t rowSize = frame->width * frame->bpp;
+  size_t stride = frame->stride * frame->bpp;
+  size_t size = rowSize * frame->height;
+
+  if (!reserveData(frame->width, frame->height)) {
+    return false;
+  }
+
+  mKeyFrame = !mDelta || mKeyFrameRequested
+    || frame->width != mKeyWidth
+    || frame->height != mKeyHeight
+    || frame->format != mKeyFormat;
+
+  const unsigned char* src = static_cast<const unsigned char*>(frame->data);
+  unsigned char* out = mEncodedData.data() + HEADER_SIZE;
+  unsigned char* pixels;
+
+  if (mKeyFrame) {
+    // Key frames are kept around for the following deltas.
+    pixels = mDelta ? mKeyPixels.data() : mCompress ? mPixels.data() : out;
+
+    if (stride == rowSize) {
+      memcpy(pixels, src, size);
+    }
+    else {
+      for (uint32_t y = 0; y < frame->height; ++y) {
+        memcpy(pixels + y * rowSize, src + y * stride, rowSize);
+      }
+    }
+  }
+  else {
+    pixels = mPixels.data();
+
+    for (uint32_t y = 0; y < frame->height; ++y) {
+      xorRow(pixels + y * rowSize, src + y * stride,
+        mKeyPixels.data() + y * rowSize, rowSize);
+    }
+  }
+
+  size_t payloadSize = mCompress ? mCompressor->compress(pixels, size, out) : size;
+
+  unsigned char* header = mEncodedData.data();
+  header[0] = (mKeyFrame ? 0 : FLAG_DELTA) | (mCompress ? FLAG_LZ4 : 0);
+  header[1] = frame->bpp;
+  header[2] = frame->format;
+  header[3] = 0;
+  putUInt32LE(header + 4, frame->width);
+  putUInt32LE(header + 8, frame->height);
+  putUInt32LE(header + 12, size);
+
+  mEncodedSize = HEADER_SIZE + payloadSize;
+
+  if (mKeyFrame) {
+    mKeyFrameRequested = false;
+    mKeyFrameSize = payloadSize;
+    mKeyWidth = frame->width;
+    mKeyHeight = frame->height;
+    mKeyFormat = frame->format;
+  }
+  else if (payloadSize > mKeyFrameSize / 2) {
+    // The screen has changed so much that a new key frame will make the
+    // following deltas a lot smaller.
+    mKeyFrameRequested = true;
+  }
+
+  return true;
+}
+
+int
+RawEncoder::getEncodedSize() {
+  return mEncodedSize;
+}
+
+unsigned char*
+RawEncoder::getEncodedData() {
+  return mEncodedData.data();
+}
+
+FrameEncoder::Reference
+RawEncoder::getReference() {
+  return mKeyFrame ? REFERENCE_NONE : REFERENCE_KEY_FRAME;
+}
+
+void
+RawEncoder::requestKeyFrame() {
+  mKeyFrameRequested = true;
+}
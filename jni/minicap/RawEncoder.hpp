@@ -0,0 +1,67 @@
+#ifndef MINICAP_RAW_ENCODER_HPP
+#define MINICAP_RAW_ENCODER_HPP
+
+#include <memory>
+#include <vector>
+
+#include "FrameEncoder.hpp"
+#include "Minicap.hpp"
+
+#include "util/lz4.hpp"
+
+// Sends the pixels as they are, optionally LZ4 compressed and XOR'd
+// against the last key frame. Costs next to no CPU and is lossless, but
+// needs a lot more bandwidth than JPEG. Meant for emulators and local
+// consumers. See the README for the format.
+class RawEncoder: public FrameEncoder {
+public:
+  static const size_t HEADER_SIZE = 16;
+
+  enum {
+    FLAG_DELTA = 0x01,
+    FLAG_LZ4   = 0x02,
+  };
+
+  RawEncoder(bool compress, bool delta);
+
+  Codec
+  getCodec();
+
+  bool
+  reserveData(uint32_t width, uint32_t height);
+
+  size_t
+  getMaxEncodedSize(uint32_t width, uint32_t height);
+
+  bool
+  encode(Minicap::Frame* frame, unsigned int quality);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+  Reference
+  getReference();
+
+  void
+  requestKeyFrame();
+
+private:
+  bool mCompress;
+  bool mDelta;
+  std::unique_ptr<lz4> mCompressor;
+  std::vector<unsigned char> mPixels;
+  std::vector<unsigned char> mKeyPixels;
+  std::vector<unsigned char> mEncodedData;
+  size_t mEncodedSize;
+  bool mKeyFrame;
+  bool mKeyFrameRequested;
+  size_t mKeyFrameSize;
+  uint32_t mKeyWidth;
+  uint32_t mKeyHeight;
+  Minicap::Format mKeyFormat;
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "SharedFrameBuffer.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __ANDROID__
+#include <linux/ashmem.h>
+#endif
+
+#include "util/debug.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+#define SHARED_MEMORY_NAME "minicap"
+
+SharedFrameBuffer::SharedFrameBuffer()
+  : mFd(-1),
+    mEventFd(-1),
+    mMemory(NULL),
+    mMemorySize(0),
+    mSlotSize(0),
+    mWriteSlot(0) {
+}
+
+SharedFrameBuffer::~SharedFrameBuffer() {
+  if (mMemory != NULL) {
+    munmap(mMemory, mMemorySize);
+  }
+
+  if (mFd >= 0) {
+    ::close(mFd);
+  }
+
+  if (mEventFd >= 0) {
+    ::close(mEventFd);
+  }
+}
+
+bool
+SharedFrameBuffer::create(size_t maxFrameSize) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  // Keep slots page aligned.
+  mSlotSize = (SLOT_HEADER_SIZE + maxFrameSize + pageSize - 1) & ~(pageSize - 1);
+  mMemorySize = HEADER_SIZE + SLOT_COUNT * mSlotSize;
+
+  if ((mFd = createSharedMemory(mMemorySize)) < 0) {
+    MCERROR("Unable to create shared memory of %zu bytes", mMemorySize);
+    return false;
+  }
+
+  // The eventfd is shared with the consumer, so it stays blocking for
+  // their convenience. Our writes would only block if the counter were to
+  // overflow, which isn't going to happen.
+  if ((mEventFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    MCERROR("Unable to create eventfd");
+    return false;
+  }
+
+  // Pages are only allocated once they're touched, so mostly unused slots
+  // don't cost much.
+  void* memory = mmap(NULL, mMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+  if (memory == MAP_FAILED) {
+    MCERROR("Unable to map shared memory");
+    return false;
+  }
+
+  mMemory = static_cast<unsigned char*>(memory);
+
+  Header* header = reinterpret_cast<Header*>(mMemory);
+  header->version = VERSION;
+  header->headerSize = HEADER_SIZE;
+  header->slotCount = SLOT_COUNT;
+  header->slotSize = mSlotSize;
+
+  // We start out writing to slot 0, slot 1 is the (empty) ready slot, and
+  // the consumer owns slot 2.
+  mWriteSlot = 0;
+  __atomic_store_n(&header->state, 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool
+SharedFrameBuffer::write(EncodedFrame* frame) {
+  if (SLOT_HEADER_SIZE + frame->getSize() > mSlotSize) {
+    MCERROR("Frame of %zu bytes too large for shared memory slot", frame->getSize());
+    return false;
+  }
+
+  unsigned char* slot = mMemory + HEADER_SIZE + mWriteSlot * mSlotSize;
+
+  uint32_t size = frame->getSize();
+  uint32_t sequence = frame->getSequence();
+  uint64_t capturedAt = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    frame->getCapturedAt().time_since_epoch()).count();
+
+  memcpy(slot, &size, sizeof(size));
+  memcpy(slot + 4, &sequence, sizeof(sequence));
+  memcpy(slot + 8, &capturedAt, sizeof(capturedAt));
+  memcpy(slot + SLOT_HEADER_SIZE, frame->getData(), frame->getSize());
+
+  Header* header = reinterpret_cast<Header*>(mMemory);
+
+  // Publish the slot and take over the previous ready slot, which the
+  // consumer either never took or has already swapped back.
+  uint32_t previous = __atomic_exchange_n(&header->state,
+    mWriteSlot | STATE_FRESH, __ATOMIC_ACQ_REL);
+
+  uint32_t slotIndex = previous & STATE_SLOT_MASK;
+  if (slotIndex >= SLOT_COUNT || slotIndex == mWriteSlot) {
+    MCINFO("Shared memory consumer corrupted the state");
+    return false;
+  }
+
+  mWriteSlot = slotIndex;
+
+  uint64_t value = 1;
+  if (::write(mEventFd, &value, sizeof(value)) < 0) {
+    return false;
+  }
+
+  return true;
+}
+
+int
+SharedFrameBuffer::createSharedMemory(size_t size) {
+  int fd = -1;
+
+#ifdef __NR_memfd_create
+  fd = syscall(__NR_memfd_create, SHARED_MEMORY_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (fd >= 0) {
+    if (ftruncate(fd, size) < 0) {
+      ::close(fd);
+      return -1;
+    }
+
+    // Make sure the consumer can't shrink the memory from under us, which
+    // would get us killed with SIGBUS.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    return fd;
+  }
+#endif
+
+#ifdef __ANDROID__
+  // Kernels older than 3.17 don't have memfd, but Android has always had
+  // ashmem.
+  fd = open("/dev/ashmem", O_RDWR | O_CLOEXEC);
+
+  if (fd >= 0) {
+    ioctl(fd, ASHMEM_SET_NAME, SHARED_MEMORY_NAME);
+
+    if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+      ::close(fd);
+      return -1;
+    }
+  }
+#endif
+
+  return fd;
+}
@@ -0,0 +1,71 @@
+#ifndef MINICAP_SHARED_FRAME_BUFFER_HPP
+#define MINICAP_SHARED_FRAME_BUFFER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "EncodedFrame.hpp"
+
+// A triple buffer in shared memory for a single local consumer. Frames are
+// written into a free slot and then swapped in as the latest one, so the
+// consumer can read them in place without any copying, and without us ever
+// having to wait for it. See the README for the layout.
+class SharedFrameBuffer {
+public:
+  static const uint32_t VERSION = 1;
+  static const uint32_t SLOT_COUNT = 3;
+  static const size_t HEADER_SIZE = 4096;
+  static const size_t SLOT_HEADER_SIZE = 16;
+
+  // Set in the state word while the ready slot holds a frame that the
+  // consumer hasn't taken yet.
+  static const uint32_t STATE_FRESH = 0x4;
+  static const uint32_t STATE_SLOT_MASK = 0x3;
+
+  SharedFrameBuffer();
+
+  ~SharedFrameBuffer();
+
+  // Creates the shared memory and the eventfd. Each slot has room for
+  // frames of up to maxFrameSize bytes.
+  bool
+  create(size_t maxFrameSize);
+
+  // Copies the frame into a free slot, makes it the latest one and
+  // signals the eventfd. Returns false if the frame doesn't fit or the
+  // consumer has corrupted the state, after which the buffer shouldn't be
+  // used anymore.
+  bool
+  write(EncodedFrame* frame);
+
+  int
+  getFd() {
+    return mFd;
+  }
+
+  int
+  getEventFd() {
+    return mEventFd;
+  }
+
+private:
+  struct Header {
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t slotCount;
+    uint32_t slotSize;
+    uint32_t state;
+  };
+
+  int mFd;
+  int mEventFd;
+  unsigned char* mMemory;
+  size_t mMemorySize;
+  size_t mSlotSize;
+  uint32_t mWriteSlot;
+
+  static int
+  createSharedMemory(size_t size);
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "SimpleServer.hpp"
 
 #include <fcntl.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -8,6 +9,8 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "util/debug.h"
+
 SimpleServer::SimpleServer(): mFd(0) {
 }
 
@@ -19,6 +22,25 @@ SimpleServer::~SimpleServer() {
 
 int
 SimpleServer::start(const char* sockname) {
+  if (strncmp(sockname, "tcp:", 4) == 0) {
+    return startTcp(sockname + 4);
+  }
+
+  return startUnix(sockname);
+}
+
+void
+SimpleServer::setSocketOptions(const SocketOptions& options) {
+  mOptions = options;
+}
+
+const SocketOptions&
+SimpleServer::getSocketOptions() const {
+  return mOptions;
+}
+
+int
+SimpleServer::startUnix(const char* sockname) {
   int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
 
   if (sfd < 0) {
@@ -43,9 +65,94 @@ SimpleServer::start(const char* sockname) {
   return mFd;
 }
 
+int
+SimpleServer::startTcp(const char* address) {
+  char host[256] = "127.0.0.1";
+  const char* port = address;
+
+  const char* separator = strrchr(address, ':');
+  if (separator != NULL) {
+    const char* begin = address;
+    const char* end = separator;
+
+    // Allow IPv6 addresses in the usual [::1]:1313 form.
+    if (*begin == '[' && end > begin && end[-1] == ']') {
+      begin += 1;
+      end -= 1;
+    }
+
+    if (end - begin <= 0 || end - begin >= (long) sizeof(host)) {
+      MCERROR("Invalid TCP address '%s'", address);
+      return -1;
+    }
+
+    memcpy(host, begin, end - begin);
+    host[end - begin] = '\0';
+    port = separator + 1;
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+  struct addrinfo* result;
+  int err = getaddrinfo(host, port, &hints, &result);
+  if (err != 0) {
+    MCERROR("Unable to resolve '%s': %s", address, gai_strerror(err));
+    return -1;
+  }
+
+  int sfd = -1;
+
+  for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if (sfd < 0) {
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (::bind(sfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+
+    ::close(sfd);
+    sfd = -1;
+  }
+
+  freeaddrinfo(result);
+
+  if (sfd < 0) {
+    return -1;
+  }
+
+  ::listen(sfd, 4);
+
+  mFd = sfd;
+
+  return mFd;
+}
+
 int
 SimpleServer::accept() {
-  struct sockaddr_un addr;
+  struct sockaddr_storage addr;
   socklen_t addr_len = sizeof(addr);
-  return ::accept(mFd, (struct sockaddr *) &addr, &addr_len);
+  int fd = ::accept(mFd, (struct sockaddr *) &addr, &addr_len);
+
+  if (fd >= 0) {
+    mOptions.apply(fd);
+  }
+
+  return fd;
+}
+
+void
+SimpleServer::shutdown() {
+  if (mFd > 0) {
+    ::shutdown(mFd, SHUT_RDWR);
+  }
 }
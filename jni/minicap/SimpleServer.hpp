@@ -1,18 +1,41 @@
 #ifndef MINICAP_SIMPLE_SERVER_HPP
 #define MINICAP_SIMPLE_SERVER_HPP
 
+#include "SocketOptions.hpp"
+
 class SimpleServer {
 public:
   SimpleServer();
   ~SimpleServer();
 
+  // Listens on the given abstract socket, or on a TCP port if the name is
+  // of the form "tcp:[<address>:]<port>". TCP servers bind to loopback
+  // unless an address is given.
   int
   start(const char* sockname);
 
+  // Options to apply to each accepted connection. Must be set before
+  // start().
+  void
+  setSocketOptions(const SocketOptions& options);
+
+  const SocketOptions&
+  getSocketOptions() const;
+
   int accept();
 
+  // Stops listening. Any pending accept() will return with an error.
+  void shutdown();
+
 private:
   int mFd;
+  SocketOptions mOptions;
+
+  int
+  startUnix(const char* sockname);
+
+  int
+  startTcp(const char* address);
 };
 
 #endif
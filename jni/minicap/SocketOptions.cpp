@@ -0,0 +1,88 @@
+#include "SocketOptions.hpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "util/debug.h"
+#include "util/option.hpp"
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+// Enough to keep the pipe full without queueing up whole stale frames.
+#define DEFAULT_NOTSENT_LOWAT 16384
+
+SocketOptions::SocketOptions()
+  : mSendBufferSize(-1),
+    mNotSentLowat(DEFAULT_NOTSENT_LOWAT),
+    mNoDelay(1) {
+}
+
+bool
+SocketOptions::set(const char* name, const char* value) {
+  long number;
+  if (!option_parse_number(value, &number)) {
+    return false;
+  }
+
+  if (strcmp(name, "sndbuf") == 0) {
+    mSendBufferSize = number;
+    return true;
+  }
+
+  if (strcmp(name, "notsent_lowat") == 0) {
+    mNotSentLowat = number;
+    return true;
+  }
+
+  if (strcmp(name, "nodelay") == 0) {
+    mNoDelay = number != 0;
+    return true;
+  }
+
+  return false;
+}
+
+bool
+SocketOptions::parse(const char* option) {
+  return option_parse(option, *this);
+}
+
+bool
+SocketOptions::apply(int fd) const {
+  bool ok = true;
+
+  if (mSendBufferSize >= 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &mSendBufferSize, sizeof(mSendBufferSize)) < 0) {
+      MCWARN("Unable to set SO_SNDBUF");
+      ok = false;
+    }
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t addrLength = sizeof(addr);
+  if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &addrLength) < 0 ||
+      (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)) {
+    return ok;
+  }
+
+  if (mNoDelay >= 0) {
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &mNoDelay, sizeof(mNoDelay)) < 0) {
+      MCWARN("Unable to set TCP_NODELAY");
+      ok = false;
+    }
+  }
+
+  if (mNotSentLowat >= 0) {
+    // Not available on older kernels, in which case we simply do without.
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &mNotSentLowat, sizeof(mNotSentLowat)) < 0) {
+      MCWARN("Unable to set TCP_NOTSENT_LOWAT");
+      ok = false;
+    }
+  }
+
+  return ok;
+}
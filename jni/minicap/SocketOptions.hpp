@@ -0,0 +1,34 @@
+#ifndef MINICAP_SOCKET_OPTIONS_HPP
+#define MINICAP_SOCKET_OPTIONS_HPP
+
+// Tunable per-connection socket options. Smaller buffers mean less data
+// queued up in the kernel and therefore lower latency, at the cost of
+// throughput. Options that haven't been set are left alone, except that
+// TCP connections get TCP_NODELAY and a modest TCP_NOTSENT_LOWAT by
+// default so that frames don't pile up in the send queue.
+class SocketOptions {
+public:
+  SocketOptions();
+
+  // Sets an option by name. Known options are "sndbuf" (SO_SNDBUF),
+  // "notsent_lowat" (TCP_NOTSENT_LOWAT) and "nodelay" (TCP_NODELAY).
+  // Returns false if the option is unknown or the value is invalid.
+  bool
+  set(const char* name, const char* value);
+
+  // Parses "<name>=<value>".
+  bool
+  parse(const char* option);
+
+  // Applies all options that have been set. TCP options are skipped for
+  // other types of sockets.
+  bool
+  apply(int fd) const;
+
+private:
+  int mSendBufferSize;
+  int mNotSentLowat;
+  int mNoDelay;
+};
+
+#endif
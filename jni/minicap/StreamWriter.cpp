@@ -0,0 +1,186 @@
+#include "StreamWriter.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "util/debug.h"
+
+#ifndef F_GETPIPE_SZ
+#define F_GETPIPE_SZ 1032
+#endif
+
+static void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+// Older platform versions don't expose vmsplice() in libc, so we go
+// through syscall() directly.
+static ssize_t
+sys_vmsplice(int fd, const struct iovec* iov, unsigned long nr_segs, unsigned int flags) {
+  return syscall(__NR_vmsplice, fd, iov, nr_segs, flags);
+}
+
+StreamWriter::StreamWriter(int fd)
+  : mFd(fd),
+    mCanSplice(false),
+    mOffset(0),
+    mHasLastFrame(false),
+    mLastFrameSequence(0) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    mCanSplice = true;
+  }
+}
+
+bool
+StreamWriter::writeData(const unsigned char* data, size_t length) {
+  struct iovec iov;
+  iov.iov_base = const_cast<unsigned char*>(data);
+  iov.iov_len = length;
+
+  return writeVector(&iov, 1);
+}
+
+bool
+StreamWriter::writeFrame(std::shared_ptr<EncodedFrame> frame, bool withHeader) {
+  std::shared_ptr<EncodedFrame> reference = frame->getReference();
+  if (reference && !hasWritten(reference.get())) {
+    if (!writeFrame(reference, withHeader)) {
+      return false;
+    }
+  }
+
+  mHasLastFrame = true;
+  mLastFrameSequence = frame->getSequence();
+
+  unsigned char* data = frame->getData();
+  size_t length = frame->getSize();
+
+  unsigned char header[4];
+  putUInt32LE(header, length);
+
+  if (mCanSplice) {
+    // The header is too small to be worth splicing, and would have to
+    // stay around until it's been read.
+    if (withHeader && !writeData(header, sizeof(header))) {
+      return false;
+    }
+
+    if (splice(data, length)) {
+      SplicedFrame spliced;
+      spliced.frame = frame;
+      spliced.endOffset = mOffset;
+      mSplicedFrames.push_back(spliced);
+      releaseSplicedFrames();
+      return true;
+    }
+
+    if (mCanSplice) {
+      return false;
+    }
+
+    // Splicing isn't supported after all. Fall back to copying, the
+    // header is already out.
+    return writeData(data, length);
+  }
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = withHeader ? sizeof(header) : 0;
+  iov[1].iov_base = data;
+  iov[1].iov_len = length;
+
+  return writeVector(iov, 2);
+}
+
+bool
+StreamWriter::writeVector(struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t wrote = ::writev(mFd, iov, count);
+
+    if (wrote < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    mOffset += wrote;
+
+    while (count > 0 && static_cast<size_t>(wrote) >= iov->iov_len) {
+      wrote -= iov->iov_len;
+      iov += 1;
+      count -= 1;
+    }
+
+    if (count > 0) {
+      iov->iov_base = static_cast<unsigned char*>(iov->iov_base) + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+
+  return true;
+}
+
+bool
+StreamWriter::hasWritten(EncodedFrame* frame) {
+  // Frames are written in order, so anything up to the last one has
+  // either been written or skipped on purpose.
+  return mHasLastFrame
+    && static_cast<int32_t>(mLastFrameSequence - frame->getSequence()) >= 0;
+}
+
+bool
+StreamWriter::splice(unsigned char* data, size_t length) {
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = length;
+
+  while (iov.iov_len > 0) {
+    ssize_t spliced = sys_vmsplice(mFd, &iov, 1, 0);
+
+    if (spliced < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == ENOSYS || errno == EINVAL) {
+        MCINFO("vmsplice() not available, copying frames instead");
+        mCanSplice = false;
+      }
+
+      return false;
+    }
+
+    iov.iov_base = static_cast<unsigned char*>(iov.iov_base) + spliced;
+    iov.iov_len -= spliced;
+    mOffset += spliced;
+  }
+
+  return true;
+}
+
+void
+StreamWriter::releaseSplicedFrames() {
+  // The pipe can't hold more than its capacity, so anything further back
+  // than that has already been read. The reader may change the capacity
+  // at any time, so check every time.
+  int pipeSize = fcntl(mFd, F_GETPIPE_SZ);
+  if (pipeSize <= 0) {
+    pipeSize = 65536;
+  }
+
+  while (!mSplicedFrames.empty() &&
+      mOffset - mSplicedFrames.front().endOffset >= static_cast<unsigned long long>(pipeSize)) {
+    mSplicedFrames.pop_front();
+  }
+}
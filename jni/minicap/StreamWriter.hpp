@@ -0,0 +1,59 @@
+#ifndef MINICAP_STREAM_WRITER_HPP
+#define MINICAP_STREAM_WRITER_HPP
+
+#include <deque>
+#include <memory>
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "EncodedFrame.hpp"
+
+// Writes a continuous stream of frames to a file descriptor, typically
+// STDOUT. If the descriptor is a pipe, frame data is spliced into it with
+// vmsplice() instead of being copied. Since the pipe then refers to our
+// memory directly, frames are kept alive until enough data has gone
+// through the pipe after them that they can't be in it anymore.
+class StreamWriter {
+public:
+  StreamWriter(int fd);
+
+  // Writes a chunk of data by copying it. Meant for small things like the
+  // banner.
+  bool
+  writeData(const unsigned char* data, size_t length);
+
+  // Writes the frame, with or without the frame header. Frames it depends
+  // on that haven't been written yet (e.g. JPEG tables, which aren't
+  // published on their own) are written first.
+  bool
+  writeFrame(std::shared_ptr<EncodedFrame> frame, bool withHeader);
+
+private:
+  struct SplicedFrame {
+    std::shared_ptr<EncodedFrame> frame;
+    unsigned long long endOffset;
+  };
+
+  int mFd;
+  bool mCanSplice;
+  unsigned long long mOffset;
+  bool mHasLastFrame;
+  uint32_t mLastFrameSequence;
+  std::deque<SplicedFrame> mSplicedFrames;
+
+  bool
+  hasWritten(EncodedFrame* frame);
+
+  // Writes all of the buffers by copying them. Modifies the iovecs.
+  bool
+  writeVector(struct iovec* iov, int count);
+
+  bool
+  splice(unsigned char* data, size_t length);
+
+  void
+  releaseSplicedFrames();
+};
+
+#endif
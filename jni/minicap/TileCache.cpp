@@ -0,0 +1,125 @@
+#include "TileCache.hpp"
+
+#include <stddef.h>
+
+TileCache::TileCache()
+  : mFrame(0),
+    mHead(NO_SLOT),
+    mTail(NO_SLOT) {
+}
+
+void
+TileCache::setCapacity(unsigned int capacity) {
+  mSlots.resize(capacity);
+  clear();
+}
+
+unsigned int
+TileCache::getCapacity() {
+  return mSlots.size();
+}
+
+void
+TileCache::clear() {
+  mIndex.clear();
+  mFrame = 0;
+  mHead = NO_SLOT;
+  mTail = NO_SLOT;
+
+  // All slots start out free, and are handed out in order.
+  for (size_t i = 0; i < mSlots.size(); ++i) {
+    mSlots[i].used = false;
+    pushFront(static_cast<uint16_t>(i));
+  }
+}
+
+void
+TileCache::nextFrame() {
+  mFrame += 1;
+}
+
+uint16_t
+TileCache::find(uint64_t hash) {
+  auto it = mIndex.find(hash);
+  if (it == mIndex.end()) {
+    return NO_SLOT;
+  }
+
+  Slot& slot = mSlots[it->second];
+  if (slot.storedIn == mFrame) {
+    return NO_SLOT;
+  }
+
+  slot.usedIn = mFrame;
+  unlink(it->second);
+  pushFront(it->second);
+
+  return it->second;
+}
+
+uint16_t
+TileCache::insert(uint64_t hash) {
+  if (mTail == NO_SLOT || mIndex.count(hash) > 0) {
+    return NO_SLOT;
+  }
+
+  uint16_t index = mTail;
+  Slot& slot = mSlots[index];
+
+  // If even the least recently used slot was used in this frame, they
+  // all were.
+  if (slot.used && slot.usedIn == mFrame) {
+    return NO_SLOT;
+  }
+
+  if (slot.used) {
+    mIndex.erase(slot.hash);
+  }
+
+  slot.hash = hash;
+  slot.used = true;
+  slot.storedIn = mFrame;
+  slot.usedIn = mFrame;
+  mIndex[hash] = index;
+
+  unlink(index);
+  pushFront(index);
+
+  return index;
+}
+
+void
+TileCache::unlink(uint16_t index) {
+  Slot& slot = mSlots[index];
+
+  if (slot.previous != NO_SLOT) {
+    mSlots[slot.previous].next = slot.next;
+  }
+  else {
+    mHead = slot.next;
+  }
+
+  if (slot.next != NO_SLOT) {
+    mSlots[slot.next].previous = slot.previous;
+  }
+  else {
+    mTail = slot.previous;
+  }
+}
+
+void
+TileCache::pushFront(uint16_t index) {
+  Slot& slot = mSlots[index];
+
+  slot.previous = NO_SLOT;
+  slot.next = mHead;
+
+  if (mHead != NO_SLOT) {
+    mSlots[mHead].previous = index;
+  }
+  else {
+    mTail = index;
+  }
+
+  mHead = index;
+}
@@ -0,0 +1,73 @@
+#ifndef MINICAP_TILE_CACHE_HPP
+#define MINICAP_TILE_CACHE_HPP
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+// Keeps track of which tiles the client has in its cache, by hash. The
+// client has a slot for each entry, and we tell it which slot to store a
+// tile in, so that it doesn't have to replicate the LRU logic itself.
+//
+// Rectangles within a frame aren't necessarily sent in the order that
+// tiles are looked up, so slots that were used in the current frame are
+// never evicted, and tiles stored in the current frame can't be referred
+// to until the next one.
+class TileCache {
+public:
+  static const uint16_t NO_SLOT = 0xFFFF;
+  static const unsigned int MAX_CAPACITY = NO_SLOT;
+
+  TileCache();
+
+  // Also clears the cache.
+  void
+  setCapacity(unsigned int capacity);
+
+  unsigned int
+  getCapacity();
+
+  void
+  clear();
+
+  // Call before looking up the tiles of a new frame.
+  void
+  nextFrame();
+
+  // Returns the slot of the tile and marks it as recently used, or
+  // NO_SLOT if it's not cached.
+  uint16_t
+  find(uint64_t hash);
+
+  // Returns the slot that the tile should be stored in, or NO_SLOT if it
+  // shouldn't be stored.
+  uint16_t
+  insert(uint64_t hash);
+
+private:
+  struct Slot {
+    uint64_t hash;
+    bool used;
+    // Frames that the slot was last stored and used in.
+    uint32_t storedIn;
+    uint32_t usedIn;
+    uint16_t previous;
+    uint16_t next;
+  };
+
+  std::vector<Slot> mSlots;
+  std::unordered_map<uint64_t, uint16_t> mIndex;
+  uint32_t mFrame;
+  // Most and least recently used slots.
+  uint16_t mHead;
+  uint16_t mTail;
+
+  void
+  unlink(uint16_t index);
+
+  void
+  pushFront(uint16_t index);
+};
+
+#endif
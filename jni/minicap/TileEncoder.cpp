@@ -0,0 +1,820 @@
+#include "TileEncoder.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "util/debug.h"
+
+// Used for regions of interest unless set otherwise.
+#define DEFAULT_REGION_QUALITY 95
+
+// Neighboring pixels that differ by at most this much (summed over the
+// channels) but aren't equal are a sign of photographic content, which
+// JPEG handles much better than a palette. UI content tends to be either
+// flat or have sharp edges.
+#define SMOOTH_GRADIENT_THRESHOLD 24
+
+// Tiles with more smooth gradients than 1/n of their pixels are treated
+// as photographic even if they have few enough colors for a palette.
+#define SMOOTH_GRADIENT_RATIO 8
+
+// Mixed into the hash of tiles in regions of interest, so that they
+// don't match the same pixels encoded at the lower quality.
+#define BOOSTED_HASH_SALT 0x5BD1E9955BD1E995ULL
+
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+// How many changed rows have to agree on a scroll distance before we
+// believe it.
+#define MIN_SCROLL_VOTES 16
+
+static void
+putUInt16LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x00FF) >> 0;
+  data[1] = (value & 0xFF00) >> 8;
+}
+
+static void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+// Packed as 0xBBGGRR, ignoring alpha like JPEG does.
+static inline uint32_t
+readColor(const unsigned char* p, const FrameEncoder::Layout* layout) {
+  return p[layout->r] | (p[layout->g] << 8) | (p[layout->b] << 16);
+}
+
+static inline uint64_t
+mixHash(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * HASH_MULTIPLIER;
+  return hash ^ (hash >> 32);
+}
+
+static inline unsigned int
+colorDistance(uint32_t a, uint32_t b) {
+  return abs(static_cast<int>(a & 0xFF) - static_cast<int>(b & 0xFF))
+    + abs(static_cast<int>((a >> 8) & 0xFF) - static_cast<int>((b >> 8) & 0xFF))
+    + abs(static_cast<int>(a >> 16) - static_cast<int>(b >> 16));
+}
+
+// std::min() takes it by reference.
+const uint32_t TileEncoder::TILE_SIZE;
+
+TileEncoder::TileEncoder()
+  : mJpgEncoder(true),
+    mDetectScroll(false),
+    mTileColumns(0),
+    mTileRows(0),
+    mKeyFrame(true),
+    mKeyFrameRequested(true),
+    mFramesSinceKeyFrame(0),
+    mBytesSinceKeyFrame(0),
+    mRegionQuality(DEFAULT_REGION_QUALITY),
+    mUsePalette(true),
+    mTablesQuality(-1),
+    mTablesBoostQuality(-1),
+    mEncodedSize(0),
+    mHeaderSize(0) {
+  memset(&mPalette, 0, sizeof(mPalette));
+}
+
+FrameEncoder::Codec
+TileEncoder::getCodec() {
+  return CODEC_TILES;
+}
+
+bool
+TileEncoder::setOption(const char* name, const char* value) {
+  if (strcmp(name, "roi") == 0) {
+    std::vector<Rect> regions;
+    if (!region_parse_list(value, regions)) {
+      return false;
+    }
+
+    mRegions.swap(regions);
+    return true;
+  }
+
+  if (strcmp(name, "roi_boost") == 0) {
+    std::vector<Rect> regions;
+    if (!region_parse_list(value, regions)) {
+      return false;
+    }
+
+    mBoostRegions.swap(regions);
+    return true;
+  }
+
+  if (strcmp(name, "roi_quality") == 0) {
+    char* end;
+    long quality = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || quality < 0 || quality > 100) {
+      return false;
+    }
+
+    mRegionQuality = quality;
+    return true;
+  }
+
+  if (strcmp(name, "cache") == 0) {
+    char* end;
+    long capacity = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || capacity < 0 || capacity > TileCache::MAX_CAPACITY) {
+      return false;
+    }
+
+    mCache.setCapacity(capacity);
+    mKeyFrameRequested = true;
+    return true;
+  }
+
+  if (strcmp(name, "scroll") == 0) {
+    if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+      return false;
+    }
+
+    mDetectScroll = value[0] == '1';
+    mKeyFrameRequested = true;
+    return true;
+  }
+
+  if (strcmp(name, "palette") == 0) {
+    if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+      return false;
+    }
+
+    mUsePalette = value[0] == '1';
+    return true;
+  }
+
+  if (!mJpgEncoder.setOption(name, value)) {
+    return false;
+  }
+
+  // The tables may have changed.
+  mTablesQuality = -1;
+
+  return true;
+}
+
+bool
+TileEncoder::reserveData(uint32_t width, uint32_t height) {
+  if (!mJpgEncoder.reserveData(width, height)) {
+    return false;
+  }
+
+  // Rectangles are encoded one at a time, and copied over as they're
+  // done. This is enough for all but the most pathological frames, and
+  // we grow the buffer as needed anyway.
+  size_t size = static_cast<size_t>(width) * height * 3;
+
+  if (size > mEncodedData.size()) {
+    MCINFO("Allocating %zu bytes for tile encoder", size);
+    mEncodedData.resize(size);
+  }
+
+  // Palette rectangles can be as large as the frame when tiles merge.
+  size_t pixels = static_cast<size_t>(width) * height;
+
+  if (pixels > mIndices.size()) {
+    mIndices.resize(pixels);
+    mPaletteData.resize(1 + MAX_PALETTE_SIZE * 3 + lz4::bound(pixels));
+  }
+
+  return true;
+}
+
+bool
+TileEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
+  mEncodedSize = 0;
+  mHeaderSize = 0;
+
+  if (!reserveData(frame->width, frame->height)) {
+    return false;
+  }
+
+  // Formats we can't read pixels from (i.e. RGB_565) simply don't get
+  // palette tiles.
+  Layout layout;
+  const Layout* tileLayout = mUsePalette && getLayout(frame->format, &layout)
+    ? &layout : NULL;
+
+  int boostQuality = mRegions.empty() && mBoostRegions.empty()
+    ? -1 : mRegionQuality;
+
+  if (static_cast<int>(quality) != mTablesQuality || boostQuality != mTablesBoostQuality) {
+    // Let the JPEG encoder come up with new tables based on the whole
+    // frame rather than whichever rectangle happens to come first.
+    mJpgEncoder.setBoostQuality(boostQuality);
+
+    if (!mJpgEncoder.encode(frame, quality)) {
+      return false;
+    }
+
+    if (mJpgEncoder.getHeaderSize() > 0) {
+      Rect rect = { 0, 0, 0, 0 };
+      putRect(mHeaderData, &mHeaderSize, rect, RECT_JPEG_TABLES,
+        mJpgEncoder.getHeaderData(), mJpgEncoder.getHeaderSize());
+    }
+
+    mTablesQuality = quality;
+    mTablesBoostQuality = boostQuality;
+  }
+
+  uint32_t columns = (frame->width + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t rows = (frame->height + TILE_SIZE - 1) / TILE_SIZE;
+
+  if (columns != mTileColumns || rows != mTileRows
+      || frame->height != mRowHashes.size()) {
+    mTileColumns = columns;
+    mTileRows = rows;
+    mTileHashes.resize(columns * rows);
+    mTileSlots.resize(columns * rows);
+    mSlotData.resize(columns * rows * 2);
+    mSegmentHashes.resize(columns * frame->height);
+    mRowHashes.resize(frame->height);
+    mPreviousRowHashes.resize(frame->height);
+    mScrollVotes.resize(frame->height * 2);
+    mKeyFrameRequested = true;
+  }
+
+  // Cached tiles may have been encoded with different tables, and new
+  // clients need everything anyway.
+  mKeyFrame = mHeaderSize > 0 || mKeyFrameRequested
+    || mFramesSinceKeyFrame >= KEY_FRAME_INTERVAL
+    || mBytesSinceKeyFrame >= KEY_FRAME_BYTES;
+
+  if (mKeyFrame) {
+    mCache.clear();
+    mKeyFrameRequested = false;
+    mFramesSinceKeyFrame = 0;
+    mBytesSinceKeyFrame = 0;
+  }
+
+  mCache.nextFrame();
+
+  mCopied.height = 0;
+
+  if (isIncremental()) {
+    hashSegments(frame);
+
+    // Moving what the client already has needs to go first, before
+    // anything is drawn over the source.
+    uint32_t sourceY;
+    if (mDetectScroll && !mKeyFrame
+        && detectScroll(frame->width, frame->height, &mCopied, &sourceY)) {
+      unsigned char source[4];
+      putUInt16LE(source + 0, mCopied.x);
+      putUInt16LE(source + 2, sourceY);
+      putRect(mEncodedData, &mEncodedSize, mCopied, RECT_COPY, source,
+        sizeof(source));
+    }
+
+    mPreviousRowHashes.swap(mRowHashes);
+  }
+
+  // Rows of tiles with exactly the same runs are merged into taller
+  // rectangles, which keeps the per-rectangle overhead down. A screen
+  // that's flat all over ends up as a single rectangle.
+  std::vector<Run> pending;
+  uint32_t pendingY = 0;
+  uint32_t pendingHeight = 0;
+
+  for (uint32_t y = 0; y < frame->height; y += TILE_SIZE) {
+    uint32_t height = std::min(TILE_SIZE, frame->height - y);
+    std::vector<Run> runs;
+
+    for (uint32_t x = 0; x < frame->width; x += TILE_SIZE) {
+      Rect tile = { x, y, std::min(TILE_SIZE, frame->width - x), height };
+      bool boosted = isRegionOfInterest(tile);
+      TileClass tileClass = isIncremental()
+        ? lookupTile(frame, tileLayout, tile, boosted)
+        : classifyTile(frame, tileLayout, tile, boosted);
+
+      if (!runs.empty() && runs.back().tileClass == tileClass) {
+        runs.back().width += tile.width;
+      }
+      else {
+        Run run = { x, tile.width, tileClass };
+        runs.push_back(run);
+      }
+    }
+
+    bool same = runs.size() == pending.size();
+    for (size_t i = 0; same && i < runs.size(); ++i) {
+      same = runs[i].x == pending[i].x && runs[i].width == pending[i].width
+        && runs[i].tileClass == pending[i].tileClass;
+    }
+
+    if (same) {
+      pendingHeight += height;
+      continue;
+    }
+
+    if (!encodeRuns(frame, tileLayout, quality, pending, pendingY, pendingHeight)) {
+      return false;
+    }
+
+    pending.swap(runs);
+    pendingY = y;
+    pendingHeight = height;
+  }
+
+  if (!encodeRuns(frame, tileLayout, quality, pending, pendingY, pendingHeight)) {
+    return false;
+  }
+
+  mFramesSinceKeyFrame += 1;
+  mBytesSinceKeyFrame += mEncodedSize;
+
+  return true;
+}
+
+int
+TileEncoder::getEncodedSize() {
+  return mEncodedSize;
+}
+
+unsigned char*
+TileEncoder::getEncodedData() {
+  return mEncodedData.data();
+}
+
+int
+TileEncoder::getHeaderSize() {
+  return mHeaderSize;
+}
+
+unsigned char*
+TileEncoder::getHeaderData() {
+  return mHeaderData.data();
+}
+
+FrameEncoder::Reference
+TileEncoder::getReference() {
+  // JPEG rectangles need the tables, and incremental frames everything
+  // since the last key frame.
+  return isIncremental() && !mKeyFrame
+    ? REFERENCE_PREVIOUS_FRAME
+    : REFERENCE_KEY_FRAME;
+}
+
+void
+TileEncoder::requestKeyFrame() {
+  mKeyFrameRequested = true;
+}
+
+TileEncoder::TileClass
+TileEncoder::classifyTile(Minicap::Frame* frame, const Layout* layout,
+    const Rect& rect, bool boosted) {
+  if (layout != NULL) {
+    const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+    size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+    size_t maxSmooth = static_cast<size_t>(rect.width) * rect.height
+      / SMOOTH_GRADIENT_RATIO;
+    size_t smooth = 0;
+    bool flat = true;
+
+    resetPalette();
+
+    for (uint32_t y = rect.y; flat && y < rect.y + rect.height; ++y) {
+      const unsigned char* p = data + y * stride + rect.x * frame->bpp;
+      const unsigned char* end = p + rect.width * frame->bpp;
+      uint32_t previous = readColor(p, layout);
+
+      if (lookupColor(previous) < 0) {
+        flat = false;
+        break;
+      }
+
+      for (p += frame->bpp; p < end; p += frame->bpp) {
+        uint32_t color = readColor(p, layout);
+
+        // Runs of the same color are by far the most common case, and
+        // need no lookup.
+        if (color == previous) {
+          continue;
+        }
+
+        if (colorDistance(color, previous) <= SMOOTH_GRADIENT_THRESHOLD
+            && ++smooth > maxSmooth) {
+          flat = false;
+          break;
+        }
+
+        if (lookupColor(color) < 0) {
+          flat = false;
+          break;
+        }
+
+        previous = color;
+      }
+    }
+
+    if (flat) {
+      return TILE_PALETTE;
+    }
+  }
+
+  return boosted ? TILE_BOOSTED : TILE_NORMAL;
+}
+
+TileEncoder::TileClass
+TileEncoder::lookupTile(Minicap::Frame* frame, const Layout* layout,
+    const Rect& rect, bool boosted) {
+  size_t index = (rect.y / TILE_SIZE) * mTileColumns + rect.x / TILE_SIZE;
+  uint64_t hash = hashTile(rect) ^ (boosted ? BOOSTED_HASH_SALT : 0);
+  bool copied = rect.y >= mCopied.y && rect.y + rect.height <= mCopied.y + mCopied.height;
+  bool unchanged = !mKeyFrame && (copied || hash == mTileHashes[index]);
+
+  mTileHashes[index] = hash;
+
+  // Looking the tile up keeps it from being evicted while it's on the
+  // screen, even if it hasn't changed.
+  uint16_t slot = mCache.find(hash);
+
+  if (unchanged) {
+    return TILE_UNCHANGED;
+  }
+
+  if (slot != TileCache::NO_SLOT) {
+    mTileSlots[index] = slot;
+    return TILE_CACHED;
+  }
+
+  mTileSlots[index] = mCache.insert(hash);
+
+  return classifyTile(frame, layout, rect, boosted);
+}
+
+bool
+TileEncoder::isRegionOfInterest(const Rect& rect) {
+  for (auto& roi: mRegions) {
+    if (region_intersects(rect, roi)) {
+      return true;
+    }
+  }
+
+  for (auto& roi: mBoostRegions) {
+    if (region_intersects(rect, roi)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+TileEncoder::isIncremental() {
+  return mCache.getCapacity() > 0 || mDetectScroll;
+}
+
+bool
+TileEncoder::encodeRuns(Minicap::Frame* frame, const Layout* layout,
+    unsigned int quality, const std::vector<Run>& runs, uint32_t y,
+    uint32_t height) {
+  for (auto& run: runs) {
+    Rect rect = { run.x, y, run.width, height };
+
+    switch (run.tileClass) {
+    case TILE_UNCHANGED:
+      break;
+    case TILE_CACHED:
+      putSlots(rect, RECT_CACHED);
+      break;
+    case TILE_NORMAL:
+    case TILE_BOOSTED:
+      if (!encodeJpeg(frame, quality, rect, run.tileClass == TILE_BOOSTED)) {
+        return false;
+      }
+      break;
+    case TILE_PALETTE:
+      if (!encodePaletteTiles(frame, layout, rect)) {
+        return false;
+      }
+      break;
+    }
+
+    // Tell the client where to keep the tiles it has just received.
+    if (mCache.getCapacity() > 0 && run.tileClass != TILE_UNCHANGED
+        && run.tileClass != TILE_CACHED) {
+      putSlots(rect, RECT_CACHE_STORE);
+    }
+  }
+
+  return true;
+}
+
+bool
+TileEncoder::encodePaletteTiles(Minicap::Frame* frame, const Layout* layout,
+    const Rect& rect) {
+  if (encodePalette(frame, layout, rect)) {
+    return true;
+  }
+
+  // Each tile fits in a palette by itself, but together they may have
+  // too many colors.
+  for (uint32_t ty = rect.y; ty < rect.y + rect.height; ty += TILE_SIZE) {
+    for (uint32_t tx = rect.x; tx < rect.x + rect.width; tx += TILE_SIZE) {
+      Rect tile = {
+        tx,
+        ty,
+        std::min(TILE_SIZE, rect.x + rect.width - tx),
+        std::min(TILE_SIZE, rect.y + rect.height - ty),
+      };
+
+      if (!encodePalette(frame, layout, tile)) {
+        MCERROR("Tile unexpectedly has too many colors for a palette");
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool
+TileEncoder::encodeJpeg(Minicap::Frame* frame, unsigned int quality,
+    const Rect& rect, bool boosted) {
+  Minicap::Frame tile = *frame;
+  tile.data = static_cast<const unsigned char*>(frame->data)
+    + (static_cast<size_t>(rect.y) * frame->stride + rect.x) * frame->bpp;
+  tile.width = rect.width;
+  tile.height = rect.height;
+  tile.size = static_cast<size_t>(rect.height) * frame->stride * frame->bpp;
+
+  bool encoded = boosted
+    ? mJpgEncoder.encodeBoosted(&tile, quality)
+    : mJpgEncoder.encode(&tile, quality);
+
+  if (!encoded) {
+    return false;
+  }
+
+  putRect(mEncodedData, &mEncodedSize, rect, RECT_JPEG,
+    mJpgEncoder.getEncodedData(), mJpgEncoder.getEncodedSize());
+
+  return true;
+}
+
+bool
+TileEncoder::encodePalette(Minicap::Frame* frame, const Layout* layout,
+    const Rect& rect) {
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+  unsigned char* indices = mIndices.data();
+
+  resetPalette();
+
+  for (uint32_t y = rect.y; y < rect.y + rect.height; ++y) {
+    const unsigned char* p = data + y * stride + rect.x * frame->bpp;
+    const unsigned char* end = p + rect.width * frame->bpp;
+    uint32_t previous = readColor(p, layout);
+    int index = lookupColor(previous);
+
+    if (index < 0) {
+      return false;
+    }
+
+    for (; p < end; p += frame->bpp) {
+      uint32_t color = readColor(p, layout);
+
+      if (color != previous) {
+        index = lookupColor(color);
+
+        if (index < 0) {
+          return false;
+        }
+
+        previous = color;
+      }
+
+      *indices++ = index;
+    }
+  }
+
+  unsigned char* out = mPaletteData.data();
+
+  *out++ = mPalette.size - 1;
+
+  for (unsigned int i = 0; i < mPalette.size; ++i) {
+    *out++ = (mPalette.colors[i] >> 0) & 0xFF;
+    *out++ = (mPalette.colors[i] >> 8) & 0xFF;
+    *out++ = (mPalette.colors[i] >> 16) & 0xFF;
+  }
+
+  out += mCompressor.compress(mIndices.data(), indices - mIndices.data(), out);
+
+  putRect(mEncodedData, &mEncodedSize, rect, RECT_PALETTE,
+    mPaletteData.data(), out - mPaletteData.data());
+
+  return true;
+}
+
+void
+TileEncoder::resetPalette() {
+  mPalette.size = 0;
+
+  if (++mPalette.generation == 0) {
+    // Wrapped around, so old slots could look current again.
+    memset(mPalette.generations, 0, sizeof(mPalette.generations));
+    mPalette.generation = 1;
+  }
+}
+
+int
+TileEncoder::lookupColor(uint32_t color) {
+  uint32_t slot = (color * 2654435761U) >> (32 - PALETTE_HASH_BITS);
+
+  while (mPalette.generations[slot] == mPalette.generation) {
+    if (mPalette.keys[slot] == color) {
+      return mPalette.indices[slot];
+    }
+
+    slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+  }
+
+  if (mPalette.size == MAX_PALETTE_SIZE) {
+    return -1;
+  }
+
+  mPalette.colors[mPalette.size] = color;
+  mPalette.keys[slot] = color;
+  mPalette.generations[slot] = mPalette.generation;
+  mPalette.indices[slot] = mPalette.size;
+
+  return mPalette.size++;
+}
+
+bool
+TileEncoder::putSlots(const Rect& rect, unsigned char type) {
+  unsigned char* out = mSlotData.data();
+  bool any = false;
+
+  for (uint32_t y = rect.y; y < rect.y + rect.height; y += TILE_SIZE) {
+    for (uint32_t x = rect.x; x < rect.x + rect.width; x += TILE_SIZE) {
+      uint16_t slot = mTileSlots[(y / TILE_SIZE) * mTileColumns + x / TILE_SIZE];
+      any = any || slot != TileCache::NO_SLOT;
+      putUInt16LE(out, slot);
+      out += 2;
+    }
+  }
+
+  if (any) {
+    putRect(mEncodedData, &mEncodedSize, rect, type, mSlotData.data(),
+      out - mSlotData.data());
+  }
+
+  return any;
+}
+
+void
+TileEncoder::putRect(std::vector<unsigned char>& data, size_t* offset,
+    const Rect& rect, unsigned char type, const unsigned char* payload, size_t size) {
+  size_t needed = *offset + RECT_HEADER_SIZE + size;
+  if (needed > data.size()) {
+    data.resize(needed + needed / 2);
+  }
+
+  unsigned char* out = data.data() + *offset;
+  putUInt16LE(out + 0, rect.x);
+  putUInt16LE(out + 2, rect.y);
+  putUInt16LE(out + 4, rect.width);
+  putUInt16LE(out + 6, rect.height);
+  out[8] = type;
+  putUInt32LE(out + 9, size);
+  memcpy(out + RECT_HEADER_SIZE, payload, size);
+
+  *offset = needed;
+}
+
+void
+TileEncoder::hashSegments(Minicap::Frame* frame) {
+  const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+  size_t stride = static_cast<size_t>(frame->stride) * frame->bpp;
+  size_t segmentSize = TILE_SIZE * frame->bpp;
+  size_t rowSize = frame->width * frame->bpp;
+  uint64_t* segments = mSegmentHashes.data();
+
+  // Every pixel is only read once, for both tile and row hashes.
+  for (uint32_t y = 0; y < frame->height; ++y) {
+    const unsigned char* row = data + y * stride;
+    uint64_t rowHash = frame->width * HASH_MULTIPLIER;
+
+    for (size_t offset = 0; offset < rowSize; offset += segmentSize) {
+      const unsigned char* p = row + offset;
+      const unsigned char* end = row + std::min(offset + segmentSize, rowSize);
+      uint64_t hash = (end - p) * HASH_MULTIPLIER;
+
+      for (; p + 8 <= end; p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = mixHash(hash, word);
+      }
+
+      for (; p < end; ++p) {
+        hash = mixHash(hash, *p);
+      }
+
+      *segments++ = hash;
+      rowHash = mixHash(rowHash, hash);
+    }
+
+    mRowHashes[y] = rowHash;
+  }
+}
+
+uint64_t
+TileEncoder::hashTile(const Rect& rect) {
+  const uint64_t* segments = mSegmentHashes.data() + rect.x / TILE_SIZE;
+  uint64_t hash = rect.height * HASH_MULTIPLIER;
+
+  for (uint32_t y = rect.y; y < rect.y + rect.height; ++y) {
+    hash = mixHash(hash, segments[y * mTileColumns]);
+  }
+
+  return hash;
+}
+
+bool
+TileEncoder::detectScroll(uint32_t width, uint32_t height, Rect* destination,
+    uint32_t* sourceY) {
+  const uint64_t* current = mRowHashes.data();
+  const uint64_t* previous = mPreviousRowHashes.data();
+
+  // Only rows that appear once say where they came from. Repeated ones
+  // (e.g. blank space) would match anywhere.
+  mRowIndex.clear();
+  for (uint32_t y = 0; y < height; ++y) {
+    auto result = mRowIndex.emplace(previous[y], y);
+    if (!result.second) {
+      result.first->second = -1;
+    }
+  }
+
+  // Let every changed row vote for the distance it moved.
+  std::fill(mScrollVotes.begin(), mScrollVotes.end(), 0);
+
+  for (uint32_t y = 0; y < height; ++y) {
+    if (current[y] == previous[y]) {
+      continue;
+    }
+
+    auto it = mRowIndex.find(current[y]);
+    if (it != mRowIndex.end() && it->second >= 0) {
+      mScrollVotes[y + height - it->second] += 1;
+    }
+  }
+
+  auto best = std::max_element(mScrollVotes.begin(), mScrollVotes.end());
+  if (*best < MIN_SCROLL_VOTES) {
+    return false;
+  }
+
+  int32_t distance = static_cast<int32_t>(best - mScrollVotes.begin()) - height;
+
+  // Find the largest area that moved by that distance, which may well
+  // include rows that didn't vote.
+  uint32_t first = std::max(distance, 0);
+  uint32_t last = height + std::min(distance, 0);
+  uint32_t start = 0;
+  uint32_t length = 0;
+
+  for (uint32_t y = first; y < last; ++y) {
+    uint32_t end = y;
+    while (end < last && current[end] == previous[end - distance]) {
+      end += 1;
+    }
+
+    if (end - y > length) {
+      start = y;
+      length = end - y;
+    }
+
+    y = end;
+  }
+
+  // Partially covered tiles are sent as usual.
+  uint32_t top = (start + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+  uint32_t bottom = start + length == height
+    ? height
+    : (start + length) / TILE_SIZE * TILE_SIZE;
+
+  if (bottom <= top) {
+    return false;
+  }
+
+  destination->x = 0;
+  destination->y = top;
+  destination->width = width;
+  destination->height = bottom - top;
+  *sourceY = top - distance;
+
+  return true;
+}
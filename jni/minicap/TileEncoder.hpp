@@ -0,0 +1,228 @@
+#ifndef MINICAP_TILE_ENCODER_HPP
+#define MINICAP_TILE_ENCODER_HPP
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "FrameEncoder.hpp"
+#include "JpgEncoder.hpp"
+#include "Minicap.hpp"
+#include "TileCache.hpp"
+
+#include "util/lz4.hpp"
+#include "util/region.hpp"
+
+// Splits frames into a grid of tiles, and encodes neighboring tiles that
+// are treated the same as a rectangle of their own. Each frame is a list
+// of such rectangles, see the README for the format. Flat tiles with few
+// colors (i.e. most of a typical UI) are encoded losslessly with a
+// palette, and the rest as JPEG. JPEG tiles that overlap a region of
+// interest get a higher quality than the rest, so that the bandwidth
+// goes where the user is looking.
+//
+// Optionally, the client keeps a cache of tiles it has seen, and tiles
+// that are already in it are sent as references rather than pixels. Also
+// optionally, vertical scrolling is detected, and the client is told to
+// move what it already has rather than getting it all over again. In
+// both cases, tiles that haven't changed since the previous frame aren't
+// sent at all, and frames depend on all the frames before them, up to
+// the last key frame.
+class TileEncoder: public FrameEncoder {
+public:
+  static const uint32_t TILE_SIZE = 64;
+  static const size_t RECT_HEADER_SIZE = 13;
+  static const unsigned int MAX_PALETTE_SIZE = 256;
+
+  // When frames depend on the previous one, a key frame is forced when
+  // either limit is reached, as clients that skip frames have to catch up
+  // on everything since the last key frame, and we have to keep all of
+  // that around.
+  static const unsigned int KEY_FRAME_INTERVAL = 300;
+  static const size_t KEY_FRAME_BYTES = 4 * 1024 * 1024;
+
+  enum {
+    RECT_JPEG        = 0,
+    RECT_JPEG_TABLES = 1,
+    RECT_PALETTE     = 2,
+    RECT_CACHED      = 3,
+    RECT_CACHE_STORE = 4,
+    RECT_COPY        = 5,
+  };
+
+  TileEncoder();
+
+  Codec
+  getCodec();
+
+  // Known options are "roi" (a space separated list of <x>,<y>,<w>,<h>
+  // rectangles, replacing the current ones), "roi_boost" (more regions
+  // of interest, kept apart from "roi" so that a boost can come and go
+  // without touching them), "roi_quality", "palette"
+  // (0 or 1), "cache" (the number of tiles the client caches, or 0 to
+  // disable caching) and "scroll" (0 or 1). Anything else goes to the
+  // JPEG encoder.
+  bool
+  setOption(const char* name, const char* value);
+
+  bool
+  reserveData(uint32_t width, uint32_t height);
+
+  bool
+  encode(Minicap::Frame* frame, unsigned int quality);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+  int
+  getHeaderSize();
+
+  unsigned char*
+  getHeaderData();
+
+  Reference
+  getReference();
+
+  void
+  requestKeyFrame();
+
+  // True with either "cache" or "scroll".
+  bool
+  isIncremental();
+
+private:
+  typedef region Rect;
+
+  enum TileClass {
+    TILE_NORMAL,
+    TILE_BOOSTED,
+    TILE_PALETTE,
+    TILE_CACHED,
+    TILE_UNCHANGED,
+  };
+
+  // Must be well over MAX_PALETTE_SIZE to keep probing short.
+  static const unsigned int PALETTE_HASH_BITS = 10;
+  static const unsigned int PALETTE_HASH_SIZE = 1 << PALETTE_HASH_BITS;
+
+  // Colors of a palette rectangle, with a hash table for finding their
+  // indices. Slots belong to the current palette only if their
+  // generation matches, which saves clearing the table for every tile.
+  struct Palette {
+    uint32_t colors[MAX_PALETTE_SIZE];
+    unsigned int size;
+    uint32_t generation;
+    uint32_t keys[PALETTE_HASH_SIZE];
+    uint32_t generations[PALETTE_HASH_SIZE];
+    unsigned char indices[PALETTE_HASH_SIZE];
+  };
+
+  // Tiles of the same class next to each other in a row of tiles.
+  struct Run {
+    uint32_t x;
+    uint32_t width;
+    TileClass tileClass;
+  };
+
+  JpgEncoder mJpgEncoder;
+  lz4 mCompressor;
+  Palette mPalette;
+  std::vector<unsigned char> mIndices;
+  std::vector<unsigned char> mPaletteData;
+  TileCache mCache;
+  bool mDetectScroll;
+  // Hashes of each row of each column of tiles, and of whole rows.
+  std::vector<uint64_t> mSegmentHashes;
+  std::vector<uint64_t> mRowHashes;
+  std::vector<uint64_t> mPreviousRowHashes;
+  std::unordered_map<uint64_t, int32_t> mRowIndex;
+  std::vector<uint32_t> mScrollVotes;
+  // The part of the screen that the client has copied from elsewhere.
+  Rect mCopied;
+  // Hash and cache slot of each tile in the grid.
+  std::vector<uint64_t> mTileHashes;
+  std::vector<uint16_t> mTileSlots;
+  uint32_t mTileColumns;
+  uint32_t mTileRows;
+  std::vector<unsigned char> mSlotData;
+  bool mKeyFrame;
+  bool mKeyFrameRequested;
+  unsigned int mFramesSinceKeyFrame;
+  size_t mBytesSinceKeyFrame;
+  std::vector<Rect> mRegions;
+  std::vector<Rect> mBoostRegions;
+  int mRegionQuality;
+  bool mUsePalette;
+  int mTablesQuality;
+  int mTablesBoostQuality;
+  std::vector<unsigned char> mEncodedData;
+  size_t mEncodedSize;
+  std::vector<unsigned char> mHeaderData;
+  size_t mHeaderSize;
+
+  TileClass
+  classifyTile(Minicap::Frame* frame, const Layout* layout, const Rect& rect,
+    bool boosted);
+
+  // Looks the tile up in the cache, and only classifies it if it has to
+  // be sent.
+  TileClass
+  lookupTile(Minicap::Frame* frame, const Layout* layout, const Rect& rect,
+    bool boosted);
+
+  bool
+  isRegionOfInterest(const Rect& rect);
+
+  void
+  hashSegments(Minicap::Frame* frame);
+
+  uint64_t
+  hashTile(const Rect& rect);
+
+  // Looks for a vertically scrolled area that can be copied from the
+  // previous frame. The destination is aligned to the tile grid.
+  bool
+  detectScroll(uint32_t width, uint32_t height, Rect* destination,
+    uint32_t* sourceY);
+
+  // Puts the cache slots of the tiles within the rectangle into a
+  // rectangle of the given type. Returns false if none of them have one.
+  bool
+  putSlots(const Rect& rect, unsigned char type);
+
+  bool
+  encodeRuns(Minicap::Frame* frame, const Layout* layout, unsigned int quality,
+    const std::vector<Run>& runs, uint32_t y, uint32_t height);
+
+  bool
+  encodeJpeg(Minicap::Frame* frame, unsigned int quality, const Rect& rect,
+    bool boosted);
+
+  // Splits the rectangle into tiles if it has too many colors for a
+  // single palette.
+  bool
+  encodePaletteTiles(Minicap::Frame* frame, const Layout* layout,
+    const Rect& rect);
+
+  // Fails if the rectangle has more than MAX_PALETTE_SIZE colors.
+  bool
+  encodePalette(Minicap::Frame* frame, const Layout* layout, const Rect& rect);
+
+  void
+  resetPalette();
+
+  // Returns the index of the color, adding it if needed, or -1 if the
+  // palette is full.
+  int
+  lookupColor(uint32_t color);
+
+  static void
+  putRect(std::vector<unsigned char>& data, size_t* offset, const Rect& rect,
+    unsigned char type, const unsigned char* payload, size_t size);
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "ZeroCopySender.hpp"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "util/debug.h"
+#include "util/pump.hpp"
+
+// Older platform headers don't know about zero copy yet.
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+ZeroCopySender::ZeroCopySender()
+  : mEnabled(false),
+    mSends(0) {
+}
+
+bool
+ZeroCopySender::enable(int fd) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+
+  if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&address), &length) != 0) {
+    return false;
+  }
+
+  if (address.ss_family != AF_INET && address.ss_family != AF_INET6) {
+    return false;
+  }
+
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+    MCINFO("MSG_ZEROCOPY not available, copying frames instead");
+    return false;
+  }
+
+  mEnabled = true;
+  return true;
+}
+
+int
+ZeroCopySender::send(int fd, struct iovec* iov, int count,
+    std::vector<std::shared_ptr<EncodedFrame>>& frames,
+    std::vector<unsigned char>& headers) {
+  size_t size = 0;
+  for (int i = 0; i < count; ++i) {
+    size += iov[i].iov_len;
+  }
+
+  if (!mEnabled || size < MIN_SIZE) {
+    return pumpv(fd, iov, count);
+  }
+
+  bool pinned = false;
+  int result = 0;
+
+  while (count > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+
+    if (wrote >= 0) {
+      mSends += 1;
+      pinned = true;
+    }
+    else if (errno == ENOBUFS) {
+      // Too many notifications are outstanding. Copying still works.
+      wrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+
+    if (wrote < 0) {
+      result = wrote;
+      break;
+    }
+
+    while (count > 0 && static_cast<size_t>(wrote) >= iov->iov_len) {
+      wrote -= iov->iov_len;
+      iov += 1;
+      count -= 1;
+    }
+
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+
+  if (pinned) {
+    Pending pending;
+    pending.send = mSends - 1;
+    pending.frames.swap(frames);
+    pending.headers.swap(headers);
+    mPending.push_back(std::move(pending));
+  }
+
+  return result;
+}
+
+bool
+ZeroCopySender::reap(int fd) {
+  bool reaped = false;
+
+  while (true) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+
+      struct sock_extended_err* err =
+        reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cmsg));
+
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      reaped = true;
+
+      // The notification covers send calls ee_info to ee_data. TCP
+      // completes them in order, so everything up to ee_data is done.
+      while (!mPending.empty() &&
+          static_cast<int32_t>(mPending.front().send - err->ee_data) <= 0) {
+        mPending.pop_front();
+      }
+
+      // The kernel had to copy after all, e.g. on loopback, in which case
+      // zero copy only adds overhead.
+      if (mEnabled && (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+        MCINFO("MSG_ZEROCOPY fell back to copying, copying frames from now on");
+        mEnabled = false;
+      }
+    }
+  }
+
+  return reaped;
+}
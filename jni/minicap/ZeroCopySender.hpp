@@ -0,0 +1,59 @@
+#ifndef MINICAP_ZERO_COPY_SENDER_HPP
+#define MINICAP_ZERO_COPY_SENDER_HPP
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "EncodedFrame.hpp"
+
+// Sends frames with MSG_ZEROCOPY on TCP sockets, so that large frames
+// aren't copied into the kernel. The kernel then reads straight from our
+// memory until it tells us that it's done, so everything that was sent is
+// held on to until then. Where zero copy isn't available (e.g. on unix
+// domain sockets or older kernels), data is simply copied as usual.
+class ZeroCopySender {
+public:
+  // Smaller sends aren't worth the page pinning and the notifications.
+  static const size_t MIN_SIZE = 16 * 1024;
+
+  ZeroCopySender();
+
+  // Turns zero copy on for the socket, if possible. Returns whether it is.
+  bool
+  enable(int fd);
+
+  // Sends all of the buffers, modifying the iovecs. Everything they point
+  // to must be in either the frames or the headers, which are taken over
+  // until the kernel no longer needs them. Returns a negative value on
+  // error, like pumpv().
+  int
+  send(int fd, struct iovec* iov, int count,
+    std::vector<std::shared_ptr<EncodedFrame>>& frames,
+    std::vector<unsigned char>& headers);
+
+  // Releases whatever the kernel is done with. Should be called when
+  // poll() reports POLLERR, as notifications arrive on the error queue.
+  // Returns false if there weren't any, i.e. the error is a real one.
+  bool
+  reap(int fd);
+
+private:
+  struct Pending {
+    // The last send call that used these.
+    uint32_t send;
+    std::vector<std::shared_ptr<EncodedFrame>> frames;
+    std::vector<unsigned char> headers;
+  };
+
+  bool mEnabled;
+  // The number of zero copy send calls so far, which is how the kernel
+  // identifies them in notifications.
+  uint32_t mSends;
+  std::deque<Pending> mPending;
+};
+
+#endif
@@ -7,27 +7,58 @@
 #include <sys/socket.h>
 #include <thread>
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <condition_variable>
+#include <deque>
 #include <chrono>
 #include <future>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <Minicap.hpp>
 
 #include "util/debug.h"
+#include "ChangeGate.hpp"
+#include "ClientManager.hpp"
+#include "EncodePool.hpp"
+#include "FramePacer.hpp"
+#include "FramePool.hpp"
 #include "JpgEncoder.hpp"
+#include "LatencyController.hpp"
+#include "MotionAdapter.hpp"
+#include "MuxServer.hpp"
+#ifdef MINICAP_WITH_OPENH264
+#include "H264Encoder.hpp"
+#endif
+#include "PngEncoder.hpp"
+#include "QoiEncoder.hpp"
+#include "RawEncoder.hpp"
 #include "SimpleServer.hpp"
+#include "SocketOptions.hpp"
+#include "StreamWriter.hpp"
+#include "TileEncoder.hpp"
 #include "Projection.hpp"
 
 #define BANNER_VERSION 1
-#define BANNER_SIZE 24
+#define BANNER_SIZE 25
 
 #define DEFAULT_SOCKET_NAME "minicap"
 #define DEFAULT_DISPLAY_ID 0
 #define DEFAULT_JPG_QUALITY 80
+#define MAX_COALESCE_MS 1000
+
+enum {
+  OUTPUT_SOCKET,
+  OUTPUT_FRAMED,
+  OUTPUT_MJPEG,
+};
 
 enum {
   QUIRK_DUMB            = 1,
@@ -40,12 +71,28 @@ usage(const char* pname) {
   fprintf(stderr,
     "Usage: %s [-h] [-n <name>]\n"
     "  -d <id>:       Display ID. (%d)\n"
+    "                 Repeat to capture several displays, each with its own -n and -P.\n"
     "  -n <name>:     Change the name of the abtract unix domain socket. (%s)\n"
+    "                 Use tcp:[<address>:]<port> to listen on TCP instead.\n"
     "  -P <value>:    Display projection (<w>x<h>@<w>x<h>/{0|90|180|270}).\n"
     "  -Q <value>:    JPEG quality (0-100).\n"
-    "  -s:            Take a screenshot and output it to stdout. Needs -P.\n"
+    "  -B <value>:    JPEG quality while a client asks for a boost (0-100). (same as -Q)\n"
+    "  -c <codec>:    Frame codec ({jpeg|jpeg-abbrev|tiles|qoi|png|raw|lz4|delta|h264}). (jpeg)\n"
+    "  -e <opt>=<v>:  Set a codec option (e.g. tables={photo|text|flat}, see README).\n"
+    "  -a <opt>=<v>:  Encode cheaply while the screen is moving ({quality|scale|settle}, see README).\n"
+    "  -s:            Take a screenshot and output it to stdout (see -c). Needs -P.\n"
+    "  -k:            Keep running and serve screenshots on request. Needs -P.\n"
+    "  -o <format>:   Stream to stdout instead of the socket ({framed|mjpeg}).\n"
+    "  -w <name>:     Also serve HTTP (MJPEG) and WebSocket clients on the given socket.\n"
+    "  -m <name>:     Also serve local clients through shared memory on the given socket.\n"
+    "  -x <name>:     Also serve all displays multiplexed over a single socket (see README).\n"
+    "  -O <opt>=<v>:  Set a socket option for each connection ({sndbuf|notsent_lowat|nodelay}).\n"
+    "  -g <opt>=<v>:  Only send frames that changed enough ({mask|threshold|interval}, see README).\n"
     "  -S:            Skip frames when they cannot be consumed quickly enough.\n"
-    "  -r <value>:    Frame rate (frames/s)"
+    "  -l <opt>=<v>:  Keep latency under a target by shedding load ({target|interval|quality}, see README).\n"
+    "  -b <ms>:       Wait up to <ms> for a burst of frames to end, and only send the last one.\n"
+    "  -r <value>:    Frame rate (frames/s)\n"
+    "  -f:            Keep the frame rate of -r constant by sending frames again.\n"
     "  -t:            Attempt to get the capture method running, then exit.\n"
     "  -i:            Get display information in JSON format. May segfault.\n"
     "  -h:            Show help.\n",
@@ -57,44 +104,105 @@ class FrameWaiter: public Minicap::FrameAvailableListener {
 public:
   FrameWaiter()
     : mPendingFrames(0),
-      mTimeout(std::chrono::milliseconds(100)),
-      mStopped(false) {
+      mTimeout(std::chrono::milliseconds(100)) {
   }
 
   int
   waitForFrame() {
     std::unique_lock<std::mutex> lock(mMutex);
 
-    while (!mStopped) {
+    while (!sStopped) {
       if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
+        takeAvailableAt(1);
+        return mPendingFrames--;
+      }
+    }
+
+    return 0;
+  }
+
+  // Like waitForFrame(), but gives up at the deadline with -ETIMEDOUT.
+  int
+  waitForFrameUntil(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!sStopped) {
+      auto until = std::min(deadline, std::chrono::steady_clock::now() + mTimeout);
+
+      if (mCondition.wait_until(lock, until, [this]{return mPendingFrames > 0;})) {
+        takeAvailableAt(1);
         return mPendingFrames--;
       }
+
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return -ETIMEDOUT;
+      }
     }
 
     return 0;
   }
 
+  // Lets more frames pile up until the deadline, and returns how many are
+  // pending then.
+  int
+  waitForMoreFramesUntil(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!sStopped && std::chrono::steady_clock::now() < deadline) {
+      mCondition.wait_until(lock, std::min(deadline,
+        std::chrono::steady_clock::now() + mTimeout));
+    }
+
+    return mPendingFrames;
+  }
+
+  int
+  getPendingFrames() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mPendingFrames;
+  }
+
+  // Forgets about pending frames, e.g. when they're about to become
+  // unavailable due to a configuration change.
+  void
+  reset() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames = 0;
+    mAvailableAt.clear();
+  }
+
   void
   reportExtraConsumption(int count) {
     std::unique_lock<std::mutex> lock(mMutex);
     mPendingFrames -= count;
+    takeAvailableAt(count);
+  }
+
+  // When we were told about the frame consumed last, which is as close as
+  // we get to when it was composed.
+  std::chrono::steady_clock::time_point
+  getLastAvailableAt() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mLastAvailableAt;
   }
 
   void
   onFrameAvailable() {
     std::unique_lock<std::mutex> lock(mMutex);
     mPendingFrames += 1;
+    mAvailableAt.push_back(std::chrono::steady_clock::now());
     mCondition.notify_one();
   }
 
-  void
+  // Stops all waiters, i.e. the streams of all displays.
+  static void
   stop() {
-    mStopped = true;
+    sStopped = true;
   }
 
-  bool
+  static bool
   isStopped() {
-    return mStopped;
+    return sStopped;
   }
 
 private:
@@ -102,27 +210,18 @@ private:
   std::condition_variable mCondition;
   std::chrono::milliseconds mTimeout;
   int mPendingFrames;
-  bool mStopped;
-};
+  std::deque<std::chrono::steady_clock::time_point> mAvailableAt;
+  std::chrono::steady_clock::time_point mLastAvailableAt;
+  static std::atomic<bool> sStopped;
 
-static int
-pumps(int fd, unsigned char* data, size_t length) {
-  do {
-    // Make sure that we don't generate a SIGPIPE even if the socket doesn't
-    // exist anymore. We'll still get an EPIPE which is perfect.
-    int wrote = send(fd, data, length, MSG_NOSIGNAL);
-
-    if (wrote < 0) {
-      return wrote;
+  void
+  takeAvailableAt(int count) {
+    while (count-- > 0 && !mAvailableAt.empty()) {
+      mLastAvailableAt = mAvailableAt.front();
+      mAvailableAt.pop_front();
     }
-
-    data += wrote;
-    length -= wrote;
   }
-  while (length > 0);
-
-  return 0;
-}
+};
 
 static int
 pumpf(int fd, unsigned char* data, size_t length) {
@@ -187,161 +286,254 @@ try_get_framebuffer_display_info(uint32_t displayId, Minicap::DisplayInfo* info)
   return 0;
 }
 
-static FrameWaiter gWaiter;
+std::atomic<bool> FrameWaiter::sStopped(false);
 
-static void
-signal_handler(int signum) {
-  switch (signum) {
-  case SIGINT:
-    MCINFO("Received SIGINT, stopping");
-    gWaiter.stop();
-    break;
-  case SIGTERM:
-    MCINFO("Received SIGTERM, stopping");
-    gWaiter.stop();
-    break;
-  default:
-    abort();
-    break;
+// Cuts pacing short when a client asks for a boost, so that it takes
+// effect right away rather than after the current frame period.
+class BoostWaker: public ClientManager::BoostListener {
+public:
+  BoostWaker(FramePacer* pacer)
+    : mPacer(pacer) {
   }
-}
 
-int
-main(int argc, char* argv[]) {
-  const char* pname = argv[0];
-  const char* sockname = DEFAULT_SOCKET_NAME;
-  uint32_t displayId = DEFAULT_DISPLAY_ID;
-  unsigned int quality = DEFAULT_JPG_QUALITY;
-  int framePeriodMs = 0;
-  bool showInfo = false;
-  bool takeScreenshot = false;
-  bool skipFrames = false;
-  bool testOnly = false;
+  void
+  onBoostRequested() {
+    mPacer->interrupt();
+  }
+
+private:
+  FramePacer* mPacer;
+};
+
+// What each display is captured with, and where it's served.
+struct DisplayOptions {
+  DisplayOptions(uint32_t id, const char* sockname)
+    : id(id),
+      sockname(sockname),
+      httpSockname(NULL),
+      shmSockname(NULL) {
+  }
+
+  uint32_t id;
   Projection proj;
+  const char* sockname;
+  const char* httpSockname;
+  const char* shmSockname;
+};
 
-  int opt;
-  while ((opt = getopt(argc, argv, "d:n:P:Q:r:siSth")) != -1) {
-    float frameRate;
-    switch (opt) {
-    case 'd':
-      displayId = atoi(optarg);
-      break;
-    case 'n':
-      sockname = optarg;
-      break;
-    case 'P': {
-      Projection::Parser parser;
-      if (!parser.parse(proj, optarg, optarg + strlen(optarg))) {
-        std::cerr << "ERROR: invalid format for -P, need <w>x<h>@<w>x<h>/{0|90|180|270}" << std::endl;
-        return EXIT_FAILURE;
-      }
-      break;
-    }
-    case 'Q':
-      quality = atoi(optarg);
-      break;
-    case 's':
-      takeScreenshot = true;
-      break;
-    case 'i':
-      showInfo = true;
-      break;
-    case 'S':
-      skipFrames = true;
-      break;
-    case 'r':
-      frameRate = atof(optarg);
-      if(frameRate <= 0.0) {
-        MCINFO("Invalid framerate '%s', expecting a float > 0", optarg);
-        return EXIT_FAILURE;
-      } else {
-        framePeriodMs = 1000/frameRate;
-        skipFrames = true;
-        MCINFO("framerate: %.2f (period %d ms)", frameRate, framePeriodMs);
-      }
-      break;
-    case 't':
-      testOnly = true;
-      break;
-    case 'h':
-      usage(pname);
-      return EXIT_SUCCESS;
-    case '?':
-    default:
-      usage(pname);
-      return EXIT_FAILURE;
-    }
+// Options that apply to the streams of all displays. Each stream starts
+// out with its own copy of the stateful parts.
+struct StreamOptions {
+  const char* codec;
+  std::vector<const char*> encoderOptions;
+  unsigned int quality;
+  int boostQuality;
+  bool takeScreenshot;
+  bool serveScreenshots;
+  bool testOnly;
+  int output;
+  bool skipFrames;
+  int coalesceMs;
+  double frameRate;
+  bool constantRate;
+  SocketOptions socketOptions;
+  ChangeGate gate;
+  MotionAdapter motion;
+  LatencyController latency;
+};
+
+static FrameEncoder*
+createEncoder(const char* codec) {
+  if (strcmp(codec, "jpeg") == 0) {
+    return new JpgEncoder(false);
   }
 
-  // Set up signal handler.
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = signal_handler;
-  sigemptyset(&sa.sa_mask);
-  sigaction(SIGTERM, &sa, NULL);
-  sigaction(SIGINT, &sa, NULL);
+  if (strcmp(codec, "jpeg-abbrev") == 0) {
+    return new JpgEncoder(true);
+  }
 
-  // Start Android's thread pool so that it will be able to serve our requests.
-  minicap_start_thread_pool();
+  if (strcmp(codec, "tiles") == 0) {
+    return new TileEncoder();
+  }
 
-  if (showInfo) {
-    Minicap::DisplayInfo info;
+  if (strcmp(codec, "qoi") == 0) {
+    return new QoiEncoder();
+  }
 
-    if (minicap_try_get_display_info(displayId, &info) != 0) {
-      if (try_get_framebuffer_display_info(displayId, &info) != 0) {
-        MCERROR("Unable to get display info");
-        return EXIT_FAILURE;
-      }
-    }
+  if (strcmp(codec, "png") == 0) {
+    return new PngEncoder();
+  }
 
-    int rotation;
-    switch (info.orientation) {
-    case Minicap::ORIENTATION_0:
-      rotation = 0;
-      break;
-    case Minicap::ORIENTATION_90:
-      rotation = 90;
-      break;
-    case Minicap::ORIENTATION_180:
-      rotation = 180;
-      break;
-    case Minicap::ORIENTATION_270:
-      rotation = 270;
-      break;
+  if (strcmp(codec, "raw") == 0) {
+    return new RawEncoder(false, false);
+  }
+
+  if (strcmp(codec, "lz4") == 0) {
+    return new RawEncoder(true, false);
+  }
+
+  if (strcmp(codec, "delta") == 0) {
+    return new RawEncoder(true, true);
+  }
+
+  if (strcmp(codec, "h264") == 0) {
+#ifdef MINICAP_WITH_OPENH264
+    return new H264Encoder();
+#else
+    MCERROR("Not built with OpenH264");
+#endif
+  }
+
+  return NULL;
+}
+
+// Applies options given with -e. Returns the first invalid one, or NULL
+// if they're all fine.
+static const char*
+applyEncoderOptions(FrameEncoder* encoder, const std::vector<const char*>& options) {
+  for (auto option: options) {
+    const char* separator = strchr(option, '=');
+    if (separator == NULL ||
+        !encoder->setOption(std::string(option, separator).c_str(), separator + 1)) {
+      return option;
     }
+  }
 
-    std::cout.precision(2);
-    std::cout.setf(std::ios_base::fixed, std::ios_base::floatfield);
+  return NULL;
+}
 
-    std::cout << "{"                                         << std::endl
-              << "    \"id\": "       << displayId    << "," << std::endl
-              << "    \"width\": "    << info.width   << "," << std::endl
-              << "    \"height\": "   << info.height  << "," << std::endl
-              << "    \"xdpi\": "     << info.xdpi    << "," << std::endl
-              << "    \"ydpi\": "     << info.ydpi    << "," << std::endl
-              << "    \"size\": "     << info.size    << "," << std::endl
-              << "    \"density\": "  << info.density << "," << std::endl
-              << "    \"fps\": "      << info.fps     << "," << std::endl
-              << "    \"secure\": "   << (info.secure ? "true" : "false") << "," << std::endl
-              << "    \"rotation\": " << rotation            << std::endl
-              << "}"                                         << std::endl;
+// Encodes on the shared pool if there is one, i.e. with several displays.
+static bool
+encodeFrame(EncodePool* encodePool, FrameEncoder* encoder, Minicap::Frame* frame,
+    unsigned int quality) {
+  if (encodePool == NULL) {
+    return encoder->encode(frame, quality);
+  }
 
-    return EXIT_SUCCESS;
+  return encodePool->run([=]() {
+    return encoder->encode(frame, quality);
+  });
+}
+
+// Wraps the output of the encoder in a frame for clients, and keeps track
+// of what it depends on. Data the encoder produced separately becomes a
+// key frame of its own.
+static std::shared_ptr<EncodedFrame>
+wrapEncodedFrame(FrameEncoder* encoder, FramePool* pool, uint32_t* sequence,
+    std::shared_ptr<EncodedFrame>* keyFrame,
+    std::shared_ptr<EncodedFrame>* previousFrame,
+    std::chrono::steady_clock::time_point capturedAt) {
+  if (encoder->getHeaderSize() > 0) {
+    std::shared_ptr<EncodedFrame> header = pool->acquire();
+    header->assign(encoder->getHeaderData(), encoder->getHeaderSize());
+    header->setSequence((*sequence)++);
+    header->setCapturedAt(capturedAt);
+
+    *keyFrame = header;
+    *previousFrame = header;
+  }
+
+  std::shared_ptr<EncodedFrame> encoded = pool->acquire();
+  encoded->assign(encoder->getEncodedData(), encoder->getEncodedSize());
+  encoded->setSequence((*sequence)++);
+  encoded->setCapturedAt(capturedAt);
+
+  switch (encoder->getReference()) {
+  case FrameEncoder::REFERENCE_NONE:
+    *keyFrame = encoded;
+    break;
+  case FrameEncoder::REFERENCE_KEY_FRAME:
+    encoded->setReference(*keyFrame);
+    break;
+  case FrameEncoder::REFERENCE_PREVIOUS_FRAME:
+    encoded->setReference(*previousFrame);
+    break;
+  }
+
+  *previousFrame = encoded;
+
+  return encoded;
+}
+
+// Consumes and releases all but the latest of the pending frames.
+static int
+skipStaleFrames(Minicap* minicap, FrameWaiter* waiter, int pending) {
+  Minicap::Frame frame;
+  int err;
+
+  // Not particularly thread safe, but the main loop should be the only
+  // consumer anyway (i.e. nothing else decreases the frame count).
+  waiter->reportExtraConsumption(pending - 1);
+
+  while (--pending >= 1) {
+    if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+      return err;
+    }
+
+    minicap->releaseConsumedFrame(&frame);
   }
 
-  proj.forceMaximumSize();
-  proj.forceAspectRatio();
+  return 0;
+}
+
+static void
+signal_handler(int signum) {
+  switch (signum) {
+  case SIGINT:
+    MCINFO("Received SIGINT, stopping");
+    FrameWaiter::stop();
+    break;
+  case SIGTERM:
+    MCINFO("Received SIGTERM, stopping");
+    FrameWaiter::stop();
+    break;
+  default:
+    abort();
+    break;
+  }
+}
 
-  if (!proj.valid()) {
-    std::cerr << "ERROR: missing or invalid -P" << std::endl;
+// Captures a single display and serves it until stopped. Returns the exit
+// status. The display is also served as the given stream of the
+// multiplexed server, if there is one.
+static int
+runStream(const StreamOptions& options, const DisplayOptions& display,
+    EncodePool* encodePool, MuxServer* mux, uint32_t stream) {
+  unsigned int quality = options.quality;
+  int boostQuality = options.boostQuality;
+  bool takeScreenshot = options.takeScreenshot;
+  bool serveScreenshots = options.serveScreenshots;
+  bool testOnly = options.testOnly;
+  int output = options.output;
+  bool skipFrames = options.skipFrames;
+  int coalesceMs = options.coalesceMs;
+  Projection proj = display.proj;
+  ChangeGate gate(options.gate);
+  MotionAdapter motion(options.motion);
+  LatencyController latency(options.latency);
+  FramePacer pacer;
+  FrameWaiter waiter;
+
+  if (!pacer.setRate(options.frameRate)) {
     return EXIT_FAILURE;
   }
 
-  std::cerr << "PID: " << getpid() << std::endl;
-  std::cerr << "INFO: Using projection " << proj << std::endl;
+  pacer.setConstant(options.constantRate);
 
-  // Disable STDOUT buffering.
-  setbuf(stdout, NULL);
+  // The options have already been checked.
+  std::unique_ptr<FrameEncoder> encoder(createEncoder(options.codec));
+  if (!encoder || applyEncoderOptions(encoder.get(), options.encoderOptions) != NULL) {
+    MCERROR("Unable to set up encoder");
+    return EXIT_FAILURE;
+  }
+
+  {
+    // Displays start at the same time, so build the line before writing
+    // it to keep them from getting mixed up.
+    std::ostringstream line;
+    line << "INFO: Using projection " << proj << std::endl;
+    std::cerr << line.str();
+  }
 
   // Set real display size.
   Minicap::DisplayInfo realInfo;
@@ -354,17 +546,31 @@ main(int argc, char* argv[]) {
   desiredInfo.height = proj.virtualHeight;
   desiredInfo.orientation = proj.rotation;
 
-  // Leave a 4-byte padding to the encoder so that we can inject the size
-  // to the same buffer.
-  JpgEncoder encoder(4, 0);
   Minicap::Frame frame;
   bool haveFrame = false;
 
+  // Encoded frames are shared by all clients.
+  FramePool pool;
+  std::shared_ptr<EncodedFrame> keyFrame;
+  std::shared_ptr<EncodedFrame> previousFrame;
+  uint32_t sequence = 0;
+  bool canRepeat = false;
+
+  // While a client is interacting with the device, frames go out as fast
+  // as possible, overriding the usual pacing and quality trade-offs.
+  BoostWaker boostWaker(&pacer);
+  std::chrono::steady_clock::time_point boostUntil;
+  bool boosted = false;
+
   // Server config.
   SimpleServer server;
+  SimpleServer httpServer;
+  SimpleServer shmServer;
+  ClientManager clients;
+  StreamWriter writer(STDOUT_FILENO);
 
   // Set up minicap.
-  Minicap* minicap = minicap_create(displayId);
+  Minicap* minicap = minicap_create(display.id);
   if (minicap == NULL) {
     return EXIT_FAILURE;
   }
@@ -393,20 +599,20 @@ main(int argc, char* argv[]) {
     goto disaster;
   }
 
-  minicap->setFrameAvailableListener(&gWaiter);
+  minicap->setFrameAvailableListener(&waiter);
 
   if (minicap->applyConfigChanges() != 0) {
     MCERROR("Unable to start minicap with current config");
     goto disaster;
   }
 
-  if (!encoder.reserveData(realInfo.width, realInfo.height)) {
-    MCERROR("Unable to reserve data for JPG encoder");
+  if (!encoder->reserveData(realInfo.width, realInfo.height)) {
+    MCERROR("Unable to reserve data for encoder");
     goto disaster;
   }
 
   if (takeScreenshot) {
-    if (!gWaiter.waitForFrame()) {
+    if (!waiter.waitForFrame()) {
       MCERROR("Unable to wait for frame");
       goto disaster;
     }
@@ -417,12 +623,12 @@ main(int argc, char* argv[]) {
       goto disaster;
     }
 
-    if (!encoder.encode(&frame, quality)) {
+    if (!encodeFrame(encodePool, encoder.get(), &frame, quality)) {
       MCERROR("Unable to encode frame");
       goto disaster;
     }
 
-    if (pumpf(STDOUT_FILENO, encoder.getEncodedData(), encoder.getEncodedSize()) < 0) {
+    if (pumpf(STDOUT_FILENO, encoder->getEncodedData(), encoder->getEncodedSize()) < 0) {
       MCERROR("Unable to output encoded frame data");
       goto disaster;
     }
@@ -431,7 +637,7 @@ main(int argc, char* argv[]) {
   }
 
   if (testOnly) {
-    if (gWaiter.waitForFrame() <= 0) {
+    if (waiter.waitForFrame() <= 0) {
       MCERROR("Did not receive any frames");
       std::cout << "FAIL" << std::endl;
       return EXIT_FAILURE;
@@ -442,11 +648,31 @@ main(int argc, char* argv[]) {
     return EXIT_SUCCESS;
   }
 
-  if (!server.start(sockname)) {
-    MCERROR("Unable to start server on namespace '%s'", sockname);
+  server.setSocketOptions(options.socketOptions);
+  httpServer.setSocketOptions(options.socketOptions);
+  shmServer.setSocketOptions(options.socketOptions);
+
+  if (output == OUTPUT_SOCKET && display.sockname != NULL && server.start(display.sockname) < 0) {
+    MCERROR("Unable to start server on '%s'", display.sockname);
+    goto disaster;
+  }
+
+  if (display.httpSockname != NULL && httpServer.start(display.httpSockname) < 0) {
+    MCERROR("Unable to start HTTP server on '%s'", display.httpSockname);
+    goto disaster;
+  }
+
+  if (display.shmSockname != NULL && shmServer.start(display.shmSockname) < 0) {
+    MCERROR("Unable to start shared memory server on '%s'", display.shmSockname);
     goto disaster;
   }
 
+  if (output != OUTPUT_SOCKET) {
+    // Let writes fail with EPIPE when the reader goes away so that we
+    // can exit cleanly.
+    signal(SIGPIPE, SIG_IGN);
+  }
+
   // Prepare banner for clients.
   unsigned char banner[BANNER_SIZE];
   banner[0] = (unsigned char) BANNER_VERSION;
@@ -458,95 +684,372 @@ main(int argc, char* argv[]) {
   putUInt32LE(banner + 18, desiredInfo.height);
   banner[22] = (unsigned char) desiredInfo.orientation;
   banner[23] = quirks;
+  banner[24] = encoder->getCodec();
+
+  if (output == OUTPUT_SOCKET) {
+    clients.setOnDemand(serveScreenshots);
+    clients.setBoostListener(&boostWaker);
+    clients.setBanner(banner, BANNER_SIZE);
+    // Room for the largest frame the encoder can come up with, which may
+    // well be more than raw RGBA for incompressible content.
+    clients.setMaxFrameSize(encoder->getMaxEncodedSize(realInfo.width, realInfo.height));
+
+    if (display.sockname != NULL) {
+      clients.listen(&server, Client::PROTOCOL_MINICAP);
+    }
 
-  int fd;
-  while (!gWaiter.isStopped() && (fd = server.accept()) > 0) {
-    MCINFO("New client connection");
+    if (display.httpSockname != NULL) {
+      clients.listen(&httpServer, Client::PROTOCOL_HTTP);
+    }
 
-    if (pumps(fd, banner, BANNER_SIZE) < 0) {
-      close(fd);
-      continue;
+    if (display.shmSockname != NULL) {
+      clients.listen(&shmServer, Client::PROTOCOL_SHM);
     }
 
-    int pending, err;
-    while (!gWaiter.isStopped() && (pending = gWaiter.waitForFrame()) > 0) {
-      auto frameAvailableAt = std::chrono::steady_clock::now();
-      if (skipFrames && pending > 1) {
-        // Skip frames if we have too many. Not particularly thread safe,
-        // but this loop should be the only consumer anyway (i.e. nothing
-        // else decreases the frame count).
-        gWaiter.reportExtraConsumption(pending - 1);
+    if (mux != NULL) {
+      mux->setStream(stream, &clients);
+    }
+  }
+  else if (output == OUTPUT_FRAMED) {
+    if (!writer.writeData(banner, BANNER_SIZE)) {
+      MCERROR("Unable to output banner");
+      goto disaster;
+    }
+  }
 
-        while (--pending >= 1) {
-          if ((err = minicap->consumePendingFrame(&frame)) != 0) {
-            if (err == -EINTR) {
-              MCINFO("Frame consumption interrupted by EINTR");
-              goto close;
-            }
-            else {
-              MCERROR("Unable to skip pending frame");
-              goto disaster;
-            }
-          }
+  int pending, err;
+  bool deferred;
+  while (!waiter.isStopped()) {
+    deferred = false;
 
+    // Don't bother with frames until somebody actually wants one. When
+    // streaming to stdout, blocking writes take care of flow control.
+    if (output == OUTPUT_SOCKET && !clients.waitForDemand(&deferred)) {
+      continue;
+    }
+
+    if (output == OUTPUT_SOCKET) {
+      std::vector<ClientManager::CodecOption> options;
+      clients.takeCodecOptions(options);
+
+      for (auto& option: options) {
+        if (!encoder->setOption(option.name.c_str(), option.value.c_str())) {
+          MCINFO("Ignoring invalid codec option '%s' from client", option.name.c_str());
+        }
+      }
+
+      ClientManager::Boost boost;
+      if (clients.takeBoostRequest(&boost)) {
+        boostUntil = boost.until;
+
+        // Only the tiles codec knows about regions of interest.
+        if (!encoder->setOption("roi_boost", boost.regions.c_str())
+            && encoder->getCodec() == FrameEncoder::CODEC_TILES) {
+          MCINFO("Ignoring invalid boost regions from client");
+        }
+      }
+
+      bool wasBoosted = boosted;
+      boosted = std::chrono::steady_clock::now() < boostUntil;
+
+      if (wasBoosted && !boosted) {
+        encoder->setOption("roi_boost", "");
+
+        // Pacing picks up again from here rather than trying to make up
+        // for the frames it would have skipped.
+        pacer.reset();
+      }
+    }
+
+    if (serveScreenshots) {
+      std::vector<ClientManager::ScreenshotRequest> requests;
+      clients.takeScreenshotRequests(requests);
+
+      for (auto& request: requests) {
+        if (request.options.hasProjection) {
+          Projection& reqProj = request.options.projection;
+          reqProj.forceMaximumSize();
+          reqProj.forceAspectRatio();
+
+          if (!reqProj.valid() ||
+              reqProj.realWidth != realInfo.width ||
+              reqProj.realHeight != realInfo.height) {
+            MCINFO("Rejecting screenshot request with incompatible projection");
+            std::shared_ptr<EncodedFrame> encoded = pool.acquire();
+            encoded->assign(NULL, 0);
+            request.client->push(encoded);
+            continue;
+          }
+
+          if (reqProj.virtualWidth != desiredInfo.width ||
+              reqProj.virtualHeight != desiredInfo.height ||
+              reqProj.rotation != desiredInfo.orientation) {
+            if (haveFrame) {
+              minicap->releaseConsumedFrame(&frame);
+              haveFrame = false;
+            }
+
+            desiredInfo.width = reqProj.virtualWidth;
+            desiredInfo.height = reqProj.virtualHeight;
+            desiredInfo.orientation = reqProj.rotation;
+
+            // Any pending frames go away with the old configuration.
+            waiter.reset();
+
+            if (minicap->setDesiredInfo(desiredInfo) != 0 ||
+                minicap->applyConfigChanges() != 0) {
+              MCERROR("Unable to apply requested projection");
+              goto disaster;
+            }
+          }
+        }
+
+        // Keep using the frame we're holding on to unless the screen has
+        // changed since. Dumb capture methods never tell us, so they always
+        // need a new frame.
+        if (haveFrame && ((quirks & QUIRK_DUMB) || waiter.getPendingFrames() > 0)) {
           minicap->releaseConsumedFrame(&frame);
+          haveFrame = false;
+        }
+
+        if (!haveFrame) {
+          if ((pending = waiter.waitForFrame()) <= 0) {
+            break;
+          }
+
+          if (pending > 1 && (err = skipStaleFrames(minicap, &waiter, pending)) != 0) {
+            MCERROR("Unable to skip pending frame");
+            goto disaster;
+          }
+
+          if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+            MCERROR("Unable to consume pending frame");
+            goto disaster;
+          }
+
+          haveFrame = true;
+        }
+
+        // Screenshots have to stand on their own, or at most depend on
+        // data that's shared by all frames (e.g. JPEG tables), which the
+        // client gets along with them if needed.
+        encoder->requestKeyFrame();
+
+        if (!encodeFrame(encodePool, encoder.get(), &frame,
+            request.options.quality >= 0 ? request.options.quality : quality)) {
+          MCERROR("Unable to encode frame");
+          goto disaster;
+        }
+
+        request.client->push(wrapEncodedFrame(encoder.get(), &pool, &sequence,
+          &keyFrame, &previousFrame, std::chrono::steady_clock::now()));
+      }
+
+      continue;
+    }
+
+    // At a constant frame rate, every frame that's due has to go out on
+    // time. If there's no new one yet, or no time left to encode one, the
+    // previous one has to do. Frames that depend on the previous one
+    // can't be repeated, though.
+    if (pacer.isConstant() && !boosted && previousFrame && canRepeat && (pacer.isBehind()
+        || (waiter.getPendingFrames() == 0 && !(motion.hasRefinement()
+          && std::chrono::steady_clock::now() >= motion.getRefinementDeadline())))) {
+      if (output == OUTPUT_SOCKET) {
+        clients.publish(previousFrame);
+      }
+      else if (!writer.writeFrame(previousFrame, output == OUTPUT_FRAMED)) {
+        MCINFO("Output closed, stopping");
+        break;
+      }
+
+      pacer.waitForNextFrame(previousFrame->getCapturedAt());
+      continue;
+    }
+
+    if (motion.hasRefinement()) {
+      pending = waiter.waitForFrameUntil(motion.getRefinementDeadline());
+
+      if (pending == -ETIMEDOUT) {
+        // The screen has settled, so send the last frame again, this time
+        // in full quality. It's a copy, so there's nothing to release.
+        std::chrono::steady_clock::time_point refinedAt;
+        Minicap::Frame* refinement = motion.takeRefinement(&refinedAt);
+
+        if (!encodeFrame(encodePool, encoder.get(), refinement, quality)) {
+          MCERROR("Unable to encode frame");
+          goto disaster;
         }
+
+        std::shared_ptr<EncodedFrame> encoded = wrapEncodedFrame(encoder.get(),
+          &pool, &sequence, &keyFrame, &previousFrame, refinedAt);
+        canRepeat = encoder->getReference() != FrameEncoder::REFERENCE_PREVIOUS_FRAME;
+
+        if (output == OUTPUT_SOCKET) {
+          clients.publish(encoded);
+        }
+        else if (!writer.writeFrame(encoded, output == OUTPUT_FRAMED)) {
+          MCINFO("Output closed, stopping");
+          break;
+        }
+
+        if (!boosted) {
+          pacer.waitForNextFrame(refinedAt);
+        }
+
+        continue;
+      }
+    }
+    else {
+      pending = waiter.waitForFrame();
+    }
+
+    if (pending <= 0) {
+      break;
+    }
+
+    auto frameAvailableAt = std::chrono::steady_clock::now();
+
+    // Transitions and animations come in bursts of frames, most of which
+    // would be stale by the time they're sent. Give the burst a moment to
+    // go on, and only encode the latest frame.
+    if (coalesceMs > 0 && !boosted) {
+      // Counts the frame we already took off the waiter, too.
+      int burst = waiter.waitForMoreFramesUntil(frameAvailableAt
+        + std::chrono::milliseconds(coalesceMs)) + 1;
+
+      if (burst > pending) {
+        frameAvailableAt = std::chrono::steady_clock::now();
       }
 
-      if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+      pending = burst;
+    }
+
+    int skipped = 0;
+    if ((skipFrames || deferred || coalesceMs > 0 || latency.isShedding() || boosted)
+        && pending > 1) {
+      // Skip frames if we have too many. If we were waiting for a rate
+      // limited client or for a burst to end, the older frames are stale
+      // anyway, and during a boost they'd only add latency.
+      skipped = pending - 1;
+      if ((err = skipStaleFrames(minicap, &waiter, pending)) != 0) {
         if (err == -EINTR) {
           MCINFO("Frame consumption interrupted by EINTR");
-          goto close;
+          continue;
         }
         else {
-          MCERROR("Unable to consume pending frame");
+          MCERROR("Unable to skip pending frame");
           goto disaster;
         }
       }
+    }
 
-      haveFrame = true;
-
-      // Encode the frame.
-      if (!encoder.encode(&frame, quality)) {
-        MCERROR("Unable to encode frame");
+    if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+      if (err == -EINTR) {
+        MCINFO("Frame consumption interrupted by EINTR");
+        continue;
+      }
+      else {
+        MCERROR("Unable to consume pending frame");
         goto disaster;
       }
+    }
 
-      // Push it out synchronously because it's fast and we don't care
-      // about other clients.
-      unsigned char* data = encoder.getEncodedData() - 4;
-      size_t size = encoder.getEncodedSize();
+    haveFrame = true;
 
-      putUInt32LE(data, size);
+    // Latency counts from when the frame was first available rather than
+    // from when we got around to it.
+    auto frameQueuedAt = waiter.getLastAvailableAt();
 
-      if (pumps(fd, data, size + 4) < 0) {
-        break;
-      }
+    bool keyFrameRequested = output == OUTPUT_SOCKET && clients.takeKeyFrameRequest();
+
+    // Drop frames that haven't changed enough to matter, unless a new
+    // client is waiting for its first one.
+    if (!gate.check(&frame, frameAvailableAt, keyFrameRequested)) {
+      minicap->releaseConsumedFrame(&frame);
+      haveFrame = false;
+      continue;
+    }
+
+    // Spare new clients from having to catch up on what the frame is
+    // relative to.
+    if (keyFrameRequested) {
+      encoder->requestKeyFrame();
+    }
+
+    // Frames in motion are replaced soon enough that a cheaper encoding
+    // will do. A boost gets the boost quality right away instead.
+    bool moving = motion.onFrame(frameAvailableAt) && !boosted;
+    if (boosted) {
+      motion.cancelRefinement();
+    }
+
+    unsigned int frameQuality = boosted
+      ? (boostQuality >= 0 ? boostQuality : quality)
+      : (moving ? motion.getQuality() : quality);
+
+    // Encode the frame.
+    if (!encodeFrame(encodePool, encoder.get(),
+        moving ? motion.reduce(&frame) : &frame, latency.getQuality(frameQuality))) {
+      MCERROR("Unable to encode frame");
+      goto disaster;
+    }
+
+    // Keep the frame around in case it turns out to be the last one, as
+    // it then has to be sent again in full quality.
+    if (moving) {
+      motion.keep(&frame, frameAvailableAt);
+    }
+
+    {
+      // Clients get the encoded frame, so we can give the raw one back
+      // right away instead of holding on to it while sending.
+      std::shared_ptr<EncodedFrame> encoded = wrapEncodedFrame(encoder.get(),
+        &pool, &sequence, &keyFrame, &previousFrame, frameAvailableAt);
+      canRepeat = encoder->getReference() != FrameEncoder::REFERENCE_PREVIOUS_FRAME;
 
       // This will call onFrameAvailable() on older devices, so we have
       // to do it here or the loop will stop.
       minicap->releaseConsumedFrame(&frame);
       haveFrame = false;
-      if(framePeriodMs > 0) {
-        std::this_thread::sleep_until(frameAvailableAt + std::chrono::milliseconds(framePeriodMs));
+
+      if (output == OUTPUT_SOCKET) {
+        clients.publish(encoded);
+      }
+      else if (!writer.writeFrame(encoded, output == OUTPUT_FRAMED)) {
+        MCINFO("Output closed, stopping");
+        break;
       }
     }
 
-close:
-    MCINFO("Closing client connection");
-    close(fd);
+    latency.onFrameSent(frameQueuedAt, std::chrono::steady_clock::now(), skipped);
 
-    // Have we consumed one frame but are still holding it?
-    if (haveFrame) {
-      minicap->releaseConsumedFrame(&frame);
+    if (!boosted) {
+      pacer.waitForNextFrame(frameAvailableAt);
     }
   }
 
+  if (mux != NULL) {
+    mux->setStream(stream, NULL);
+  }
+
+  clients.stop();
+
+  if (haveFrame) {
+    minicap->releaseConsumedFrame(&frame);
+  }
+
   minicap_free(minicap);
 
   return EXIT_SUCCESS;
 
 disaster:
+  if (mux != NULL) {
+    mux->setStream(stream, NULL);
+  }
+
+  clients.stop();
+
   if (haveFrame) {
     minicap->releaseConsumedFrame(&frame);
   }
@@ -555,3 +1058,389 @@ disaster:
 
   return EXIT_FAILURE;
 }
+
+int
+main(int argc, char* argv[]) {
+  const char* pname = argv[0];
+  std::vector<DisplayOptions> displays(1, DisplayOptions(DEFAULT_DISPLAY_ID, DEFAULT_SOCKET_NAME));
+  bool hasDisplayId = false;
+  const char* muxSockname = NULL;
+  unsigned int quality = DEFAULT_JPG_QUALITY;
+  int boostQuality = -1;
+  bool showInfo = false;
+  bool takeScreenshot = false;
+  bool serveScreenshots = false;
+  int output = OUTPUT_SOCKET;
+  bool skipFrames = false;
+  bool constantRate = false;
+  int coalesceMs = 0;
+  bool testOnly = false;
+  SocketOptions socketOptions;
+  ChangeGate gate;
+  MotionAdapter motion;
+  double frameRate = 0;
+  LatencyController latency;
+  const char* codec = "jpeg";
+  std::unique_ptr<FrameEncoder> encoder(createEncoder(codec));
+  std::vector<const char*> encoderOptions;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:P:Q:B:c:e:r:fsko:w:m:x:O:g:a:b:l:iSth")) != -1) {
+    double rate;
+    switch (opt) {
+    case 'd':
+      // Every -d after the first adds a display, and the -n, -P, -w and -m
+      // after it apply to that one.
+      if (hasDisplayId) {
+        displays.push_back(DisplayOptions(0, NULL));
+      }
+      displays.back().id = atoi(optarg);
+      hasDisplayId = true;
+      break;
+    case 'n':
+      displays.back().sockname = optarg;
+      break;
+    case 'w':
+      displays.back().httpSockname = optarg;
+      break;
+    case 'm':
+      displays.back().shmSockname = optarg;
+      break;
+    case 'x':
+      muxSockname = optarg;
+      break;
+    case 'O':
+      if (!socketOptions.parse(optarg)) {
+        std::cerr << "ERROR: invalid socket option for -O, need {sndbuf|notsent_lowat|nodelay}=<value>" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'g':
+      if (!gate.parse(optarg)) {
+        std::cerr << "ERROR: invalid option for -g, need {mask|threshold|interval}=<value>" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'l':
+      if (!latency.parse(optarg)) {
+        std::cerr << "ERROR: invalid option for -l, need {target|interval|quality}=<value>" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'a':
+      if (!motion.parse(optarg)) {
+        std::cerr << "ERROR: invalid option for -a, need {quality|scale|settle}=<value>" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'P': {
+      Projection::Parser parser;
+      if (!parser.parse(displays.back().proj, optarg, optarg + strlen(optarg))) {
+        std::cerr << "ERROR: invalid format for -P, need <w>x<h>@<w>x<h>/{0|90|180|270}" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'Q':
+      quality = atoi(optarg);
+      break;
+    case 'B':
+      boostQuality = atoi(optarg);
+      break;
+    case 'c':
+      codec = optarg;
+      encoder.reset(createEncoder(codec));
+      if (!encoder) {
+        std::cerr << "ERROR: invalid codec for -c, need {jpeg|jpeg-abbrev|tiles|qoi|png|raw|lz4|delta|h264}" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'e':
+      encoderOptions.push_back(optarg);
+      break;
+    case 's':
+      takeScreenshot = true;
+      break;
+    case 'k':
+      serveScreenshots = true;
+      break;
+    case 'o':
+      if (strcmp(optarg, "framed") == 0) {
+        output = OUTPUT_FRAMED;
+      }
+      else if (strcmp(optarg, "mjpeg") == 0) {
+        output = OUTPUT_MJPEG;
+      }
+      else {
+        std::cerr << "ERROR: invalid format for -o, need {framed|mjpeg}" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'i':
+      showInfo = true;
+      break;
+    case 'S':
+      skipFrames = true;
+      break;
+    case 'b':
+      coalesceMs = atoi(optarg);
+      if (coalesceMs <= 0 || coalesceMs > MAX_COALESCE_MS) {
+        std::cerr << "ERROR: invalid delay for -b, need 1-" << MAX_COALESCE_MS << " ms" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'r':
+      rate = atof(optarg);
+      if(rate <= 0.0) {
+        MCINFO("Invalid framerate '%s', expecting a float > 0", optarg);
+        return EXIT_FAILURE;
+      } else {
+        frameRate = rate;
+        skipFrames = true;
+        MCINFO("framerate: %.2f (period %.3f ms)", frameRate, 1000/frameRate);
+      }
+      break;
+    case 'f':
+      constantRate = true;
+      break;
+    case 't':
+      testOnly = true;
+      break;
+    case 'h':
+      usage(pname);
+      return EXIT_SUCCESS;
+    case '?':
+    default:
+      usage(pname);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Options depend on the codec, which may only have been selected after
+  // them.
+  const char* invalidOption = applyEncoderOptions(encoder.get(), encoderOptions);
+  if (invalidOption != NULL) {
+    std::cerr << "ERROR: invalid option for -e with codec " << codec << ": " << invalidOption << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  bool anyHttp = false;
+  bool anyShm = false;
+  for (auto& display: displays) {
+    anyHttp = anyHttp || display.httpSockname != NULL;
+    anyShm = anyShm || display.shmSockname != NULL;
+
+    // Displays may be served through the multiplexed socket only.
+    if (display.sockname == NULL && muxSockname == NULL) {
+      std::cerr << "ERROR: display " << display.id << " needs its own -n" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (display.shmSockname != NULL && strncmp(display.shmSockname, "tcp:", 4) == 0) {
+      std::cerr << "ERROR: -m needs a unix domain socket for passing the shared memory" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (displays.size() > 1 && (output != OUTPUT_SOCKET || takeScreenshot || testOnly || showInfo)) {
+    std::cerr << "ERROR: -o, -s, -t and -i only work with a single display" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (output != OUTPUT_SOCKET && (serveScreenshots || anyHttp || anyShm)) {
+    std::cerr << "ERROR: -o cannot be combined with -k, -w or -m" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (muxSockname != NULL &&
+      (output != OUTPUT_SOCKET || takeScreenshot || serveScreenshots || testOnly || showInfo)) {
+    std::cerr << "ERROR: -x cannot be combined with -o, -s, -k, -t or -i" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (displays.size() > MuxClient::MAX_STREAMS) {
+    std::cerr << "ERROR: too many displays, the maximum is " << MuxClient::MAX_STREAMS << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (encoder->getCodec() != FrameEncoder::CODEC_JPEG &&
+      (output == OUTPUT_MJPEG || anyHttp)) {
+    std::cerr << "ERROR: -o mjpeg and -w need the jpeg codec" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (anyShm && (strcmp(codec, "delta") == 0 || strcmp(codec, "h264") == 0 ||
+      strcmp(codec, "jpeg-abbrev") == 0 || strcmp(codec, "tiles") == 0)) {
+    std::cerr << "ERROR: -m cannot be combined with the delta, h264, jpeg-abbrev and tiles codecs" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (constantRate && frameRate <= 0) {
+    std::cerr << "ERROR: -f needs -r" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Frames that depend on the previous one can't be sent again. Deltas
+  // only depend on the key frame, so they're fine.
+  if (constantRate && encoder->isIncremental()) {
+    std::cerr << "ERROR: -f cannot be combined with the h264 codec, or the tiles codec with cache or scroll" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Switching quality or size all the time would throw away whatever
+  // state these keep between frames.
+  if (motion.isEnabled() && (strcmp(codec, "delta") == 0 ||
+      strcmp(codec, "h264") == 0 || strcmp(codec, "tiles") == 0)) {
+    std::cerr << "ERROR: -a cannot be combined with the delta, h264 and tiles codecs" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (takeScreenshot && (strcmp(codec, "jpeg-abbrev") == 0 || strcmp(codec, "tiles") == 0)) {
+    std::cerr << "ERROR: -s cannot be combined with the jpeg-abbrev and tiles codecs" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Set up signal handler.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  // Start Android's thread pool so that it will be able to serve our requests.
+  minicap_start_thread_pool();
+
+  if (showInfo) {
+    Minicap::DisplayInfo info;
+
+    if (minicap_try_get_display_info(displays[0].id, &info) != 0) {
+      if (try_get_framebuffer_display_info(displays[0].id, &info) != 0) {
+        MCERROR("Unable to get display info");
+        return EXIT_FAILURE;
+      }
+    }
+
+    int rotation;
+    switch (info.orientation) {
+    case Minicap::ORIENTATION_0:
+      rotation = 0;
+      break;
+    case Minicap::ORIENTATION_90:
+      rotation = 90;
+      break;
+    case Minicap::ORIENTATION_180:
+      rotation = 180;
+      break;
+    case Minicap::ORIENTATION_270:
+      rotation = 270;
+      break;
+    }
+
+    std::cout.precision(2);
+    std::cout.setf(std::ios_base::fixed, std::ios_base::floatfield);
+
+    std::cout << "{"                                         << std::endl
+              << "    \"id\": "       << displays[0].id << "," << std::endl
+              << "    \"width\": "    << info.width   << "," << std::endl
+              << "    \"height\": "   << info.height  << "," << std::endl
+              << "    \"xdpi\": "     << info.xdpi    << "," << std::endl
+              << "    \"ydpi\": "     << info.ydpi    << "," << std::endl
+              << "    \"size\": "     << info.size    << "," << std::endl
+              << "    \"density\": "  << info.density << "," << std::endl
+              << "    \"fps\": "      << info.fps     << "," << std::endl
+              << "    \"secure\": "   << (info.secure ? "true" : "false") << "," << std::endl
+              << "    \"rotation\": " << rotation            << std::endl
+              << "}"                                         << std::endl;
+
+    return EXIT_SUCCESS;
+  }
+
+  for (auto& display: displays) {
+    display.proj.forceMaximumSize();
+    display.proj.forceAspectRatio();
+
+    if (!display.proj.valid()) {
+      std::cerr << "ERROR: missing or invalid -P" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::cerr << "PID: " << getpid() << std::endl;
+
+  // Disable STDOUT buffering.
+  setbuf(stdout, NULL);
+
+  StreamOptions options;
+  options.codec = codec;
+  options.encoderOptions = encoderOptions;
+  options.quality = quality;
+  options.boostQuality = boostQuality;
+  options.takeScreenshot = takeScreenshot;
+  options.serveScreenshots = serveScreenshots;
+  options.testOnly = testOnly;
+  options.output = output;
+  options.skipFrames = skipFrames;
+  options.coalesceMs = coalesceMs;
+  options.frameRate = frameRate;
+  options.constantRate = constantRate;
+  options.socketOptions = socketOptions;
+  options.gate = gate;
+  options.motion = motion;
+  options.latency = latency;
+
+  // The multiplexed server is shared by all displays, so it lives here
+  // rather than in runStream().
+  SimpleServer muxServer;
+  MuxServer mux(displays.size());
+
+  if (muxSockname != NULL) {
+    muxServer.setSocketOptions(socketOptions);
+
+    if (muxServer.start(muxSockname) < 0) {
+      MCERROR("Unable to start multiplexed server on '%s'", muxSockname);
+      return EXIT_FAILURE;
+    }
+
+    mux.listen(&muxServer);
+  }
+
+  MuxServer* muxOrNull = muxSockname != NULL ? &mux : NULL;
+
+  if (displays.size() == 1) {
+    return runStream(options, displays[0], NULL, muxOrNull, 0);
+  }
+
+  // Every display gets a thread of its own for capturing and serving, but
+  // the encoding is done by a shared pool with no more threads than there
+  // are cores.
+  EncodePool encodePool(std::max(1u, std::min(static_cast<unsigned int>(displays.size()),
+    std::thread::hardware_concurrency())));
+
+  std::vector<std::thread> threads;
+  std::vector<int> results(displays.size(), EXIT_SUCCESS);
+
+  for (size_t i = 0; i < displays.size(); ++i) {
+    threads.push_back(std::thread([&, i]() {
+      results[i] = runStream(options, displays[i], &encodePool, muxOrNull, i);
+
+      // One display failing takes the others down with it, as whoever
+      // started us will have to start over anyway.
+      if (results[i] != EXIT_SUCCESS) {
+        FrameWaiter::stop();
+      }
+    }));
+  }
+
+  for (auto& thread: threads) {
+    thread.join();
+  }
+
+  for (int result: results) {
+    if (result != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#ifndef MINICAP_UTIL_BASE64_HPP
+#define MINICAP_UTIL_BASE64_HPP
+
+#include <cstddef>
+
+// Encodes the input as base64 into out, which must have room for
+// ((length + 2) / 3) * 4 + 1 characters. Returns the encoded length.
+static inline size_t
+base64_encode(const unsigned char* in, size_t length, char* out) {
+  static const char table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  char* start = out;
+
+  for (size_t i = 0; i < length; i += 3) {
+    unsigned int value = in[i] << 16;
+
+    if (i + 1 < length) {
+      value |= in[i + 1] << 8;
+    }
+
+    if (i + 2 < length) {
+      value |= in[i + 2];
+    }
+
+    *out++ = table[(value >> 18) & 0x3F];
+    *out++ = table[(value >> 12) & 0x3F];
+    *out++ = i + 1 < length ? table[(value >> 6) & 0x3F] : '=';
+    *out++ = i + 2 < length ? table[value & 0x3F] : '=';
+  }
+
+  *out = '\0';
+
+  return out - start;
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef MINICAP_UTIL_LZ4_HPP
+#define MINICAP_UTIL_LZ4_HPP
+
+#include <cstdint>
+#include <cstring>
+
+// A minimal LZ4 block compressor. The output is a plain LZ4 block (no
+// frame header), which any LZ4 implementation can decompress with e.g.
+// LZ4_decompress_safe(). Speed is favored over ratio, as we're mostly
+// compressing XOR deltas that are zero almost everywhere.
+class lz4 {
+public:
+  // The largest possible output for the given input size.
+  static size_t
+  bound(size_t length) {
+    return length + length / 255 + 16;
+  }
+
+  lz4() {
+    memset(mTable, 0, sizeof(mTable));
+  }
+
+  // Compresses the input into out, which must have room for at least
+  // bound(length) bytes. Returns the compressed size.
+  size_t
+  compress(const unsigned char* in, size_t length, unsigned char* out) {
+    unsigned char* op = out;
+    size_t anchor = 0;
+
+    if (length > MIN_LENGTH) {
+      size_t ip = 0;
+      size_t limit = length - MF_LIMIT;
+      size_t matchLimit = length - LAST_LITERALS;
+      size_t misses = 0;
+
+      // The table may still have positions from the previous input, but
+      // they're verified before use anyway.
+      while (ip < limit) {
+        uint32_t sequence = read32(in + ip);
+        uint32_t hash = (sequence * 2654435761U) >> (32 - HASH_LOG);
+        size_t ref = mTable[hash];
+        mTable[hash] = ip;
+
+        if (ref >= ip || ip - ref > MAX_DISTANCE || read32(in + ref) != sequence) {
+          // Step faster through data that doesn't compress.
+          ip += 1 + (misses++ >> SKIP_STRENGTH);
+          continue;
+        }
+
+        misses = 0;
+
+        while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+          ip -= 1;
+          ref -= 1;
+        }
+
+        size_t matchLength = MIN_MATCH + countMatch(in, ip + MIN_MATCH,
+          ref + MIN_MATCH, matchLimit);
+
+        op = putSequence(op, in + anchor, ip - anchor, ip - ref, matchLength);
+
+        ip += matchLength;
+        anchor = ip;
+
+        if (ip < limit) {
+          mTable[(read32(in + ip - 2) * 2654435761U) >> (32 - HASH_LOG)] = ip - 2;
+        }
+      }
+    }
+
+    // The last bytes are always literals.
+    size_t literals = length - anchor;
+    op = putLength(op, literals >= 15 ? 0xF0 : literals << 4, literals, 4);
+    memcpy(op, in + anchor, literals);
+    op += literals;
+
+    return op - out;
+  }
+
+private:
+  static const int HASH_LOG = 16;
+  static const int SKIP_STRENGTH = 6;
+  static const size_t MIN_MATCH = 4;
+  static const size_t MF_LIMIT = 12;
+  static const size_t LAST_LITERALS = 5;
+  static const size_t MIN_LENGTH = MF_LIMIT + 1;
+  static const size_t MAX_DISTANCE = 65535;
+
+  uint32_t mTable[1 << HASH_LOG];
+
+  static uint32_t
+  read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  static uint64_t
+  read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  // Counts matching bytes, a word at a time where possible.
+  static size_t
+  countMatch(const unsigned char* in, size_t ip, size_t ref, size_t limit) {
+    size_t start = ip;
+
+    while (ip + 8 <= limit) {
+      uint64_t diff = read64(in + ip) ^ read64(in + ref);
+      if (diff != 0) {
+        // Little endian, so the first mismatching byte is the lowest one.
+        return ip - start + (__builtin_ctzll(diff) >> 3);
+      }
+
+      ip += 8;
+      ref += 8;
+    }
+
+    while (ip < limit && in[ip] == in[ref]) {
+      ip += 1;
+      ref += 1;
+    }
+
+    return ip - start;
+  }
+
+  // Writes the token (or adds to it) followed by the extra length bytes.
+  static unsigned char*
+  putLength(unsigned char* op, unsigned char token, size_t length, int shift) {
+    *op++ = token;
+
+    if ((token >> shift & 0xF) == 0xF) {
+      length -= 15;
+      while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+      }
+      *op++ = length;
+    }
+
+    return op;
+  }
+
+  static unsigned char*
+  putSequence(unsigned char* op, const unsigned char* literals,
+      size_t literalLength, size_t distance, size_t matchLength) {
+    unsigned char* token = op;
+
+    op = putLength(op, literalLength >= 15 ? 0xF0 : literalLength << 4,
+      literalLength, 4);
+
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    *op++ = distance & 0xFF;
+    *op++ = distance >> 8;
+
+    matchLength -= MIN_MATCH;
+
+    if (matchLength >= 15) {
+      *token |= 0x0F;
+      matchLength -= 15;
+      while (matchLength >= 255) {
+        *op++ = 255;
+        matchLength -= 255;
+      }
+      *op++ = matchLength;
+    }
+    else {
+      *token |= matchLength;
+    }
+
+    return op;
+  }
+};
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef MINICAP_UTIL_OPTION_HPP
+#define MINICAP_UTIL_OPTION_HPP
+
+#include <stdlib.h>
+#include <string.h>
+
+// Splits "<name>=<value>" and hands both to the set() method of the
+// target, which is what all of our <name>=<value> flags come down to.
+template<typename T>
+static inline bool
+option_parse(const char* option, T& target) {
+  const char* separator = strchr(option, '=');
+  if (separator == NULL || separator - option >= 32) {
+    return false;
+  }
+
+  char name[32];
+  memcpy(name, option, separator - option);
+  name[separator - option] = '\0';
+
+  return target.set(name, separator + 1);
+}
+
+// Parses a non-negative decimal number, rejecting anything else.
+static inline bool
+option_parse_number(const char* value, long* number) {
+  char* end;
+  *number = strtol(value, &end, 10);
+  return *value != '\0' && *end == '\0' && *number >= 0;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef MINICAP_UTIL_PUMP_HPP
+#define MINICAP_UTIL_PUMP_HPP
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Sends all of the data, or fails with a negative value.
+static inline int
+pumps(int fd, const unsigned char* data, size_t length) {
+  do {
+    // Make sure that we don't generate a SIGPIPE even if the socket doesn't
+    // exist anymore. We'll still get an EPIPE which is perfect.
+    int wrote = send(fd, data, length, MSG_NOSIGNAL);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    data += wrote;
+    length -= wrote;
+  }
+  while (length > 0);
+
+  return 0;
+}
+
+// Like pumps(), but for several buffers at once. Modifies the iovecs.
+static inline int
+pumpv(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    while (count > 0 && static_cast<size_t>(wrote) >= iov->iov_len) {
+      wrote -= iov->iov_len;
+      iov += 1;
+      count -= 1;
+    }
+
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MINICAP_UTIL_REGION_HPP
+#define MINICAP_UTIL_REGION_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+struct region {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+static inline bool
+region_intersects(const region& a, const region& b) {
+  return a.x < b.x + b.width && b.x < a.x + a.width &&
+    a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+// Parses a space separated list of <x>,<y>,<w>,<h> rectangles, and
+// appends them to regions. An empty list is fine.
+static inline bool
+region_parse_list(const char* value, std::vector<region>& regions) {
+  const char* p = value;
+
+  while (true) {
+    while (*p == ' ') {
+      p += 1;
+    }
+
+    if (*p == '\0') {
+      return true;
+    }
+
+    unsigned long values[4];
+    for (int i = 0; i < 4; ++i) {
+      char* end;
+      values[i] = strtoul(p, &end, 10);
+
+      if (end == p || values[i] > 0xFFFF) {
+        return false;
+      }
+
+      p = end;
+
+      if (i < 3) {
+        if (*p != ',') {
+          return false;
+        }
+
+        p += 1;
+      }
+    }
+
+    if (*p != ' ' && *p != '\0') {
+      return false;
+    }
+
+    region r = {
+      static_cast<uint32_t>(values[0]),
+      static_cast<uint32_t>(values[1]),
+      static_cast<uint32_t>(values[2]),
+      static_cast<uint32_t>(values[3]),
+    };
+
+    regions.push_back(r);
+  }
+}
+
+#endif
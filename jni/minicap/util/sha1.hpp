@@ -0,0 +1,136 @@
+#ifndef MINICAP_UTIL_SHA1_HPP
+#define MINICAP_UTIL_SHA1_HPP
+
+#include <cstdint>
+#include <cstring>
+
+// A minimal SHA-1 implementation, only meant for the WebSocket handshake.
+class sha1 {
+public:
+  static const size_t DIGEST_SIZE = 20;
+
+  sha1()
+    : mLength(0),
+      mBufferLength(0) {
+    mState[0] = 0x67452301;
+    mState[1] = 0xEFCDAB89;
+    mState[2] = 0x98BADCFE;
+    mState[3] = 0x10325476;
+    mState[4] = 0xC3D2E1F0;
+  }
+
+  void
+  update(const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+    mLength += length;
+
+    while (length > 0) {
+      size_t take = 64 - mBufferLength;
+      if (take > length) {
+        take = length;
+      }
+
+      memcpy(mBuffer + mBufferLength, bytes, take);
+      mBufferLength += take;
+      bytes += take;
+      length -= take;
+
+      if (mBufferLength == 64) {
+        process(mBuffer);
+        mBufferLength = 0;
+      }
+    }
+  }
+
+  void
+  final(unsigned char digest[DIGEST_SIZE]) {
+    uint64_t bits = mLength * 8;
+    unsigned char pad = 0x80;
+
+    update(&pad, 1);
+
+    pad = 0;
+    while (mBufferLength != 56) {
+      update(&pad, 1);
+    }
+
+    unsigned char length[8];
+    for (int i = 0; i < 8; ++i) {
+      length[i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+    }
+
+    update(length, 8);
+
+    for (int i = 0; i < 20; ++i) {
+      digest[i] = static_cast<unsigned char>(mState[i / 4] >> (24 - (i % 4) * 8));
+    }
+  }
+
+private:
+  uint32_t mState[5];
+  uint64_t mLength;
+  unsigned char mBuffer[64];
+  size_t mBufferLength;
+
+  static uint32_t
+  rol(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+  }
+
+  void
+  process(const unsigned char* block) {
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+        (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 80; ++i) {
+      w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = mState[0];
+    uint32_t b = mState[1];
+    uint32_t c = mState[2];
+    uint32_t d = mState[3];
+    uint32_t e = mState[4];
+
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      }
+      else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      }
+      else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      }
+      else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+
+      uint32_t temp = rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    mState[0] += a;
+    mState[1] += b;
+    mState[2] += c;
+    mState[3] += d;
+    mState[4] += e;
+  }
+};
+
+#endif